@@ -1,24 +1,36 @@
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <poll.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <readline/readline.h>
 #include <readline/history.h>
 
 #include "jchat.h"
+#include "sanitize.h"
 
 pthread_mutex_t msg_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t write_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t exit_wait_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t exit_wait_cond = PTHREAD_COND_INITIALIZER;
 pthread_t pt_user_input, pt_server_processing, pt_server;
@@ -28,6 +40,23 @@ struct node *tail = NULL;
 struct winsize w;
 
 static struct client_state g_client_state = {0};
+static struct latency_stats g_latency = {0};
+static struct reassembly *g_reassembly = NULL; /* g_reassembly_cap slots; they grow with the room */
+static uint32_t g_reassembly_cap = 0;
+static size_t g_reassembly_bytes = 0;
+static struct typing_user *g_typing_users = NULL; /* g_typing_users_cap slots, likewise */
+static uint32_t g_typing_users_cap = 0;
+static struct typing_state g_typing = { .sent = TYPING_END_CMD };
+static struct history_index g_history = {0};
+static struct row_index g_rows = {0};
+static struct search_index g_search_index = {0};
+static struct search_results g_search = {0};
+static struct view g_view = {0};
+static struct node *g_mark = NULL;
+static struct highlight_rules g_highlight = {0};
+static const char *g_urgent_mode_names[URGENT_NUM_MODES] = {
+    "every message", "messages from others", "highlights", "nothing"
+};
 
 void ignore_signal(int signum)
 {
@@ -35,46 +64,525 @@ void ignore_signal(int signum)
 
 void update_prompt(void)
 {
+    char progress[PROMPT_SIZE] = {0};
+    int len = 0;
+
     printf("%s", CLEAR_LINE);
+    if (g_client_state.send_progress) {
+        len += snprintf(progress + len, sizeof(progress) - len, "[>%u%%]", g_client_state.send_progress);
+    }
+    if (g_client_state.recv_progress) {
+        len += snprintf(progress + len, sizeof(progress) - len, "[<%u%%]", g_client_state.recv_progress);
+    }
+    if (g_view.bottom && g_view.new_below) {
+        len += snprintf(progress + len, sizeof(progress) - len, "[%u new below]", g_view.new_below);
+    }
+
     if (g_client_state.num_pending_msg > 0) {
-        snprintf(g_client_state.prompt, PROMPT_SIZE, "*(%u)%s%s> ",
+        snprintf(g_client_state.prompt, PROMPT_SIZE, "*(%u)%s%s%s> ",
             g_client_state.num_pending_msg,
             g_client_state.clear_mode ? "!" : "",
-            g_client_state.key);
+            g_client_state.key, progress);
     } else {
-        snprintf(g_client_state.prompt, PROMPT_SIZE, "%s%s> ",
+        snprintf(g_client_state.prompt, PROMPT_SIZE, "%s%s%s> ",
             g_client_state.clear_mode ? "!" : "",
-            g_client_state.key);
+            g_client_state.key, progress);
     }
     rl_set_prompt(g_client_state.prompt);
 }
 
-void write_msg(int fd, struct msg *msg)
+/* client-side write_msg; frames from the input and paste threads must not interleave */
+void send_msg(int fd, struct msg *msg)
+{
+    pthread_mutex_lock(&write_mutex);
+    write_msg(fd, msg);
+    pthread_mutex_unlock(&write_mutex);
+}
+
+struct node *history_lookup(uint32_t id)
+{
+    if (id < g_history.first_id || id >= g_history.next_id) {
+        return NULL;
+    }
+
+    return g_history.slots[g_history.start + (id - g_history.first_id)];
+}
+
+/* local date, to tell when timestamps from yesterday start printing differently */
+static int day_number(void)
+{
+    struct tm now;
+    time_t now_time = time(NULL);
+
+    localtime_r(&now_time, &now);
+    return now.tm_year * 366 + now.tm_yday;
+}
+
+/* rows the entries at 1..i take */
+static uint64_t rows_upto(uint32_t i)
+{
+    uint64_t sum = 0;
+
+    for (; i > 0; i -= i & -i) {
+        sum += g_rows.tree[i];
+    }
+    return sum;
+}
+
+static void rows_add(uint32_t id, uint64_t delta)
+{
+    uint32_t i;
+
+    for (i = id - g_rows.base + 1; i <= g_rows.size; i += i & -i) {
+        g_rows.tree[i] += delta;
+    }
+}
+
+/* the entry holding row rows + 1 (counting from 1 at the top of the oldest), or NULL if there are only
+ * that many. a descent through the tree, so O(log n) */
+static struct node *rows_find(uint64_t rows)
+{
+    uint32_t pos = 0, step;
+
+    for (step = g_rows.size; step > 0; step >>= 1) {
+        if (pos + step <= g_rows.size && g_rows.tree[pos + step] <= rows) {
+            pos += step;
+            rows -= g_rows.tree[pos];
+        }
+    }
+    return pos < g_rows.size ? history_lookup(g_rows.base + pos) : NULL;
+}
+
+/* lays out the whole history at cols, once; after that appends and deletes keep it up to date */
+static void rows_build(uint32_t cols)
+{
+    uint32_t used = g_history.next_id - g_history.first_id;
+    uint32_t size = 1024, i, j;
+    struct node *node;
+
+    while (size < used * 2) {
+        size *= 2;
+    }
+    free(g_rows.tree);
+    g_rows.tree = calloc(size + 1, sizeof(uint64_t));
+    if (g_rows.tree == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    g_rows.size = size;
+    g_rows.base = g_history.first_id;
+    g_rows.cols = cols;
+    g_rows.day = day_number();
+
+    for (i = 1; i <= used; i++) {
+        if ((node = history_lookup(g_rows.base + i - 1)) != NULL) {
+            g_rows.tree[i] = node_rows(node, cols);
+        }
+    }
+    /* each entry passes its sum on to its parent: O(n) rather than n updates */
+    for (i = 1; i <= size; i++) {
+        j = i + (i & -i);
+        if (j <= size) {
+            g_rows.tree[j] += g_rows.tree[i];
+        }
+    }
+}
+
+static void history_append(struct node *node)
 {
-    unsigned int total_written = 0, bytes_written;
-    while (total_written < sizeof(struct msg)) {
-        bytes_written = write(fd, ((char *)msg) + total_written, sizeof(struct msg) - total_written);
-        if (bytes_written > 0) {
-            total_written += bytes_written;
+    size_t used = g_history.next_id - g_history.first_id;
+    struct node **slots;
+
+    if (g_history.start + used == g_history.cap) {
+        if (g_history.start >= g_history.cap / 2 && g_history.start > 0) {
+            /* mostly trimmed from the front; slide down instead of growing */
+            memmove(g_history.slots, g_history.slots + g_history.start, used * sizeof(struct node *));
+            g_history.start = 0;
         } else {
-            return;
+            slots = realloc(g_history.slots, (g_history.cap ? g_history.cap * 2 : 1024) * sizeof(struct node *));
+            if (slots == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            g_history.slots = slots;
+            g_history.cap = g_history.cap ? g_history.cap * 2 : 1024;
+        }
+    }
+
+    node->id = g_history.next_id++;
+    g_history.slots[g_history.start + used] = node;
+
+    if (g_rows.cols) {
+        if (node->id - g_rows.base < g_rows.size) {
+            rows_add(node->id, node_rows(node, g_rows.cols));
+        } else {
+            /* out of room; the next goto_page() builds a bigger one */
+            g_rows.cols = 0;
+        }
+    }
+}
+
+static void history_remove(struct node *node)
+{
+    uint32_t i;
+
+    if (history_lookup(node->id) != node) {
+        return;
+    }
+
+    if (g_rows.cols) {
+        i = node->id - g_rows.base + 1;
+        rows_add(node->id, rows_upto(i - 1) - rows_upto(i));
+    }
+    g_history.slots[g_history.start + (node->id - g_history.first_id)] = NULL;
+    while (g_history.first_id < g_history.next_id && g_history.slots[g_history.start] == NULL) {
+        g_history.start++;
+        g_history.first_id++;
+    }
+    if (g_history.first_id == g_history.next_id) {
+        g_history.start = 0;
+    }
+}
+
+static const char *node_text(struct node *node)
+{
+    return node->text ? node->text : node->msg.msg;
+}
+
+static uint32_t trigram_key(const char *s)
+{
+    return ((uint32_t)(unsigned char)tolower((unsigned char)s[0]) << 16 |
+        (uint32_t)(unsigned char)tolower((unsigned char)s[1]) << 8 |
+        (uint32_t)(unsigned char)tolower((unsigned char)s[2])) + 1;
+}
+
+static struct posting *posting_slot(uint32_t key)
+{
+    /* multiplicative hash; trigram keys are dense in the low bits */
+    uint32_t i = (key * 2654435761u) & g_search_index.mask;
+
+    while (g_search_index.table[i].key && g_search_index.table[i].key != key) {
+        i = (i + 1) & g_search_index.mask;
+    }
+
+    return &g_search_index.table[i];
+}
+
+static struct posting *posting_find(uint32_t key)
+{
+    struct posting *p;
+
+    if (g_search_index.table == NULL) {
+        return NULL;
+    }
+    p = posting_slot(key);
+
+    return p->key ? p : NULL;
+}
+
+static void posting_table_grow(void)
+{
+    struct posting *old = g_search_index.table;
+    uint32_t old_size = old ? g_search_index.mask + 1 : 0;
+    uint32_t size = old_size ? old_size * 2 : 4096;
+
+    g_search_index.table = calloc(size, sizeof(struct posting));
+    if (g_search_index.table == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    g_search_index.mask = size - 1;
+
+    for (uint32_t i = 0; i < old_size; i++) {
+        if (old[i].key) {
+            *posting_slot(old[i].key) = old[i];
+        }
+    }
+    free(old);
+}
+
+static void id_append(uint32_t **ids, uint32_t *len, uint32_t *cap, uint32_t id)
+{
+    uint32_t *grown;
+
+    if (*len == *cap) {
+        grown = realloc(*ids, (*cap ? *cap * 2 : 4) * sizeof(uint32_t));
+        if (grown == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+        *ids = grown;
+        *cap = *cap ? *cap * 2 : 4;
+    }
+    (*ids)[(*len)++] = id;
+}
+
+/* called from add_new_message for every new node */
+void search_index_add(struct node *node)
+{
+    const char *text = node_text(node);
+    size_t len;
+    struct posting *p;
+
+    if (node->msg.type != MSG_NORMAL) {
+        return;
+    }
+    g_search_index.live++;
+
+    len = strlen(text);
+    if (len > SEARCH_INDEX_MAX_TEXT) {
+        id_append(&g_search_index.unindexed, &g_search_index.unindexed_len,
+            &g_search_index.unindexed_cap, node->id);
+        return;
+    }
+
+    for (size_t i = 0; i + 3 <= len; i++) {
+        if (g_search_index.table == NULL || g_search_index.used * 2 >= g_search_index.mask) {
+            posting_table_grow();
+        }
+        p = posting_slot(trigram_key(text + i));
+        if (p->key == 0) {
+            p->key = trigram_key(text + i);
+            g_search_index.used++;
+        }
+        /* ids only ever increase, so a repeat within this message is always the last entry */
+        if (p->len == 0 || p->ids[p->len - 1] != node->id) {
+            id_append(&p->ids, &p->len, &p->cap, node->id);
+        }
+    }
+}
+
+static void search_index_free(void)
+{
+    if (g_search_index.table) {
+        for (uint32_t i = 0; i <= g_search_index.mask; i++) {
+            free(g_search_index.table[i].ids);
+        }
+    }
+    free(g_search_index.table);
+    free(g_search_index.unindexed);
+    memset(&g_search_index, 0, sizeof(g_search_index));
+}
+
+void search_index_rebuild(void)
+{
+    search_index_free();
+    for (struct node *iter = root; iter; iter = iter->next) {
+        search_index_add(iter);
+    }
+}
+
+/* called from delete_node once the node is unlinked. postings are pruned lazily, by rebuilding once
+ * deleted ids outnumber live ones; until then lookups of deleted ids just come back NULL */
+void search_index_forget(struct node *node)
+{
+    if (node->msg.type != MSG_NORMAL) {
+        return;
+    }
+
+    g_search_index.live--;
+    g_search_index.dead++;
+    if (g_search_index.dead > SEARCH_REBUILD_MIN && g_search_index.dead > g_search_index.live) {
+        search_index_rebuild();
+    }
+}
+
+static int match_ci_at(const char *s, const char *needle, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        if (tolower((unsigned char)s[i]) != needle[i]) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+#ifdef __SSE2__
+static inline __m128i lower_epi8(__m128i v)
+{
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+        _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+
+    return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+#endif
+
+/* case-insensitive substring search; needle must already be lowercase. compares the first and last byte
+ * of the needle against 16 positions at a time and only verifies where both match */
+const char *find_ci(const char *hay, size_t hay_len, const char *needle, size_t needle_len)
+{
+    size_t i = 0;
+
+    if (needle_len == 0) {
+        return hay;
+    }
+    if (needle_len > hay_len) {
+        return NULL;
+    }
+
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+
+    for (; i + needle_len - 1 + 16 <= hay_len; i += 16) {
+        __m128i block_first = lower_epi8(_mm_loadu_si128((const __m128i *)(hay + i)));
+        __m128i block_last = lower_epi8(_mm_loadu_si128((const __m128i *)(hay + i + needle_len - 1)));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+            _mm_cmpeq_epi8(block_last, last)));
+
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (needle_len <= 2 || match_ci_at(hay + i + bit + 1, needle + 1, needle_len - 2)) {
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    for (; i + needle_len <= hay_len; i++) {
+        if (match_ci_at(hay + i, needle, needle_len)) {
+            return hay + i;
         }
     }
+
+    return NULL;
+}
+
+static int search_match(struct node *node, struct search_query *query)
+{
+    const char *text;
+
+    if (node == NULL || node->msg.type != MSG_NORMAL) {
+        return 0;
+    }
+    if (query->nick[0] && strcasecmp(node->msg.nick, query->nick) != 0) {
+        return 0;
+    }
+    if ((query->after && node->msg.time < query->after) || (query->before && node->msg.time > query->before)) {
+        return 0;
+    }
+    text = node_text(node);
+
+    return find_ci(text, strlen(text), query->text, query->len) != NULL;
+}
+
+/* ">HH:MM" / "<HH:MM" (the hour may be a single digit) -> that time today. s runs on past the filter,
+ * so the time has to end there, at a space or the end. returns -1 if it isn't a time of day */
+static time_t parse_today(const char *s)
+{
+    struct tm tm;
+    time_t now = time(NULL);
+    int hour, min, colon, end;
+
+    /* %d on its own would take a sign, leading blanks, "7:5" and "7:05pm" */
+    if (!isdigit((unsigned char)s[0]) || sscanf(s, "%2d:%n%2d%n", &hour, &colon, &min, &end) != 2 ||
+            !isdigit((unsigned char)s[colon]) || end - colon != 2 || (s[end] != '\0' && s[end] != ' ') ||
+            hour > 23 || min > 59) {
+        return -1;
+    }
+    localtime_r(&now, &tm);
+    tm.tm_hour = hour;
+    tm.tm_min = min;
+    tm.tm_sec = 0;
+
+    return mktime(&tm);
 }
 
-int read_msg(int fd, struct msg *msg)
+/* handles "s ...". caller must hold msg_mutex */
+void search_history(const char *args)
 {
-    unsigned int total_read = 0, bytes_read;
-    while (total_read < sizeof(struct msg)) {
-        bytes_read = read(fd, ((char *)msg) + total_read, sizeof(struct msg) - total_read);
-        if (bytes_read > 0) {
-            total_read += bytes_read;
+    struct search_query query = {0};
+    struct posting *best = NULL, *p;
+    uint32_t *ids = NULL, len = 0, cap = 0, total = 0, i, j, id;
+    uint64_t start = now_ns();
+    const char *end, *full = args;
+    struct node *iter;
+    time_t when;
+
+    /* leading filters, then the text to look for */
+    while (*args == ' ') {
+        args++;
+    }
+    while (*args == '@' || *args == '>' || *args == '<') {
+        end = strchr(args, ' ');
+        end = end ? end : args + strlen(args);
+        if (*args == '@') {
+            snprintf(query.nick, sizeof(query.nick), "%.*s", (int)(end - args - 1), args + 1);
         } else {
-            break;
+            when = parse_today(args + 1);
+            if (when < 0) {
+                add_info_message("search: \"%.*s\" isn't a time; use >HH:MM or <HH:MM", (int)(end - args), args);
+                return;
+            }
+            if (*args == '>') {
+                query.after = when;
+            } else {
+                query.before = when + 59;
+            }
         }
+        args = end;
+        while (*args == ' ') {
+            args++;
+        }
+    }
+    for (query.len = 0; args[query.len] && query.len < sizeof(query.text) - 1; query.len++) {
+        query.text[query.len] = tolower((unsigned char)args[query.len]);
+    }
+
+    if (query.len >= 3) {
+        /* only messages in the shortest posting list (plus unindexed ones) can contain the text */
+        for (i = 0; i + 3 <= query.len; i++) {
+            p = posting_find(trigram_key(query.text + i));
+            if (p == NULL) {
+                best = NULL;
+                break;
+            }
+            if (best == NULL || p->len < best->len) {
+                best = p;
+            }
+        }
+        /* both lists are ascending; merged newest first, so the cap keeps the newest of either */
+        i = best ? best->len : 0;
+        j = g_search_index.unindexed_len;
+        while (i > 0 || j > 0) {
+            if (j == 0 || (i > 0 && best->ids[i - 1] > g_search_index.unindexed[j - 1])) {
+                id = best->ids[--i];
+            } else {
+                id = g_search_index.unindexed[--j];
+            }
+            if (search_match(history_lookup(id), &query) && total++ < SEARCH_MAX_RESULTS) {
+                id_append(&ids, &len, &cap, id);
+            }
+        }
+    } else {
+        /* too short to use the index; scan everything, newest first */
+        for (iter = tail; iter; iter = iter->prev) {
+            if (search_match(iter, &query) && total++ < SEARCH_MAX_RESULTS) {
+                id_append(&ids, &len, &cap, iter->id);
+            }
+        }
+    }
+    for (i = 0; i < len / 2; i++) {
+        id = ids[i];
+        ids[i] = ids[len - 1 - i];
+        ids[len - 1 - i] = id;
     }
 
-    return total_read;
+    snprintf(g_search.query, sizeof(g_search.query), "%s", full);
+    free(g_search.ids);
+    g_search.ids = ids;
+    g_search.count = len;
+    g_search.total = total;
+    g_search.elapsed_ns = now_ns() - start;
+    g_search.active = 1;
+}
+
+void close_search(void)
+{
+    free(g_search.ids);
+    memset(&g_search, 0, sizeof(g_search));
 }
 
 void clear_history(void)
@@ -90,6 +598,9 @@ void clear_history(void)
 
     while (iter) {
         next = iter->next;
+        free(iter->text);
+        free(iter->spans);
+        free(iter->layout_marks);
         memset(iter, 0, sizeof(struct node));
         free(iter);
         iter = next;
@@ -97,6 +608,18 @@ void clear_history(void)
     root = NULL;
     tail = NULL;
 
+    /* ids keep counting up so nothing stale can resolve to a new node */
+    free(g_history.slots);
+    g_history.slots = NULL;
+    g_history.start = 0;
+    g_history.cap = 0;
+    g_history.first_id = g_history.next_id;
+    search_index_free();
+    close_search();
+    g_view.bottom = NULL;
+    g_view.new_below = 0;
+    g_mark = NULL;
+
     rl_clear_history();
 }
 
@@ -133,6 +656,18 @@ void delete_node(struct node *node)
     if (node == root) {
         root = node->next;
     }
+    if (node == g_view.bottom) {
+        /* keep the view pinned to what's around it */
+        g_view.bottom = node->prev ? node->prev : node->next;
+    }
+    if (node == g_mark) {
+        g_mark = NULL;
+    }
+    history_remove(node);
+    search_index_forget(node);
+    free(node->text);
+    free(node->spans);
+    free(node->layout_marks);
     memset(node, 0, sizeof(struct node));
     free(node);
     node = NULL;
@@ -145,10 +680,18 @@ void copy_msg(struct node *dst, struct msg *src)
     dst->msg.user_id = src->user_id;
     dst->msg.time = src->time;
     dst->msg.type = src->type;
+    memcpy(dst->msg.trace, src->trace, sizeof(dst->msg.trace));
+    dst->layout_cols = 0;
 }
 
 
-void add_new_message(struct msg *msg)
+struct node *add_new_message(struct msg *msg)
+{
+    return add_long_message(msg, NULL);
+}
+
+/* like add_new_message, but the node takes ownership of text (if not NULL) instead of using msg->msg */
+struct node *add_long_message(struct msg *msg, char *text)
 {
     struct node *new = NULL;
     struct node *iter;
@@ -158,18 +701,36 @@ void add_new_message(struct msg *msg)
     if (root == NULL) {
         root = malloc(sizeof(struct node));
         copy_msg(root, msg);
+        root->text = text;
+        root->spans = NULL;
+        root->num_spans = 0;
+        root->layout_marks = NULL;
+        root->layout_num_marks = 0;
         root->next = NULL;
         root->prev = NULL;
         tail = root;
     } else {
         new = malloc(sizeof(struct node));
         copy_msg(new, msg);
+        new->text = text;
+        new->spans = NULL;
+        new->num_spans = 0;
+        new->layout_marks = NULL;
+        new->layout_num_marks = 0;
         new->next = NULL;
         // update tail
         tail->next = new;
         new->prev = tail;
         tail = new;
     }
+    history_append(tail);
+    search_index_add(tail);
+    if (tail->msg.type == MSG_MARK) {
+        g_mark = tail;
+    }
+    if (g_view.bottom) {
+        g_view.new_below++;
+    }
 
     // trim history for transient mode
     if (g_client_state.transient_mode) {
@@ -187,338 +748,1552 @@ void add_new_message(struct msg *msg)
             iter = prev;
         }
     }
+
+    return tail;
 }
 
-void update_display(void)
+/* zero- and double-width ranges, sorted; everything else from U+00A0 up is one column. this is the
+ * usual wcwidth split (combining marks, CJK, hangul, fullwidth forms, emoji) without going through the
+ * locale, so every client lays out the same text the same way */
+static const struct {
+    uint32_t first;
+    uint32_t last;
+    uint8_t width;
+} g_width_ranges[] = {
+    { 0x0300, 0x036F, 0 }, /* combining diacritics */
+    { 0x0483, 0x0489, 0 },
+    { 0x0591, 0x05BD, 0 },
+    { 0x0610, 0x061A, 0 },
+    { 0x064B, 0x065F, 0 },
+    { 0x1100, 0x115F, 2 }, /* hangul jamo */
+    { 0x1160, 0x11FF, 0 },
+    { 0x1AB0, 0x1AFF, 0 },
+    { 0x1DC0, 0x1DFF, 0 },
+    { 0x200B, 0x200F, 0 }, /* zero width space, joiners, direction marks */
+    { 0x202A, 0x202E, 0 },
+    { 0x2060, 0x2064, 0 },
+    { 0x20D0, 0x20FF, 0 },
+    { 0x231A, 0x231B, 2 },
+    { 0x2329, 0x232A, 2 },
+    { 0x23E9, 0x23EC, 2 },
+    { 0x25FD, 0x25FE, 2 },
+    { 0x2614, 0x2615, 2 },
+    { 0x2E80, 0x303E, 2 }, /* CJK radicals and punctuation */
+    { 0x3041, 0x33FF, 2 }, /* kana, CJK compatibility */
+    { 0x3400, 0x4DBF, 2 },
+    { 0x4E00, 0x9FFF, 2 },
+    { 0xA000, 0xA4CF, 2 }, /* yi */
+    { 0xA960, 0xA97F, 2 },
+    { 0xAC00, 0xD7A3, 2 }, /* hangul syllables */
+    { 0xF900, 0xFAFF, 2 },
+    { 0xFE00, 0xFE0F, 0 }, /* variation selectors */
+    { 0xFE10, 0xFE19, 2 },
+    { 0xFE20, 0xFE2F, 0 },
+    { 0xFE30, 0xFE6F, 2 },
+    { 0xFEFF, 0xFEFF, 0 },
+    { 0xFF00, 0xFF60, 2 }, /* fullwidth forms */
+    { 0xFFE0, 0xFFE6, 2 },
+    { 0x16FE0, 0x16FE4, 2 },
+    { 0x17000, 0x18CFF, 2 },
+    { 0x1B000, 0x1B2FF, 2 },
+    { 0x1F004, 0x1F004, 2 },
+    { 0x1F0CF, 0x1F0CF, 2 },
+    { 0x1F18E, 0x1F18E, 2 },
+    { 0x1F191, 0x1F19A, 2 },
+    { 0x1F200, 0x1F251, 2 },
+    { 0x1F300, 0x1F64F, 2 }, /* emoji */
+    { 0x1F680, 0x1F6FF, 2 },
+    { 0x1F7E0, 0x1F7EB, 2 },
+    { 0x1F900, 0x1F9FF, 2 },
+    { 0x1FA70, 0x1FAFF, 2 },
+    { 0x20000, 0x2FFFD, 2 },
+    { 0x30000, 0x3FFFD, 2 },
+    { 0xE0001, 0xE007F, 0 }, /* tags */
+    { 0xE0100, 0xE01EF, 0 },
+};
+
+/* columns a code point takes on screen; control characters take none */
+int codepoint_width(uint32_t cp)
 {
-    int count = 0, i;
-    struct node *iter;
-    struct tm timeinfo;
-    struct tm now;
-    time_t now_time;
-    char time_str[BUF_SIZE];
+    size_t lo = 0, hi = sizeof(g_width_ranges) / sizeof(g_width_ranges[0]), mid;
 
-    // save cursor
-    printf("%s", SAVE_CURSOR);
+    if (cp < 0x20 || (cp >= 0x7F && cp < 0xA0)) {
+        return 0;
+    }
+    if (cp < 0x300) {
+        return 1;
+    }
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (cp < g_width_ranges[mid].first) {
+            hi = mid;
+        } else if (cp > g_width_ranges[mid].last) {
+            lo = mid + 1;
+        } else {
+            return g_width_ranges[mid].width;
+        }
+    }
+    return 1;
+}
 
-    // first, count # of messages to print
-    iter = root;
-    while (iter != NULL && count < MAX_DISPLAY_MESSAGES) {
-        iter = iter->next;
-        count++;
+/* length of the run of printable ASCII at the start of s, eight bytes at a time. a byte is printable
+ * when its high bit is clear and bit 5 or 6 is set (adding 0x60 to those two bits carries into bit 7
+ * exactly when one of them is), and it isn't DEL (the classic zero-byte test on word ^ 0x7F..) */
+static size_t ascii_run(const char *s, size_t len)
+{
+    const uint64_t high = 0x8080808080808080ULL, mid = 0x6060606060606060ULL;
+    const uint64_t ones = 0x0101010101010101ULL, del = 0x7F7F7F7F7F7F7F7FULL;
+    uint64_t word, x;
+    size_t i = 0;
+
+    while (i + 8 <= len) {
+        memcpy(&word, s + i, sizeof(word));
+        x = word ^ del;
+        if ((~word & ((word & mid) + mid) & high) != high || ((x - ones) & ~x & high)) {
+            break;
+        }
+        i += 8;
+    }
+    while (i < len && (unsigned char)s[i] >= 0x20 && (unsigned char)s[i] < 0x7F) {
+        i++;
     }
+    return i;
+}
 
-    // clear screen (skipping input bar)
-    for (i = w.ws_row; i != 0; i--) {
-        printf("%s", LINE_UP);
-        printf("%s", CLEAR_LINE);
+/* display width of a line of text */
+size_t utf8_width(const char *s, size_t len)
+{
+    size_t width = 0, i = 0, n;
+    uint32_t cp;
+
+    while (i < len) {
+        n = ascii_run(s + i, len - i);
+        width += n;
+        i += n;
+        if (i < len) {
+            i += utf8_decode(s + i, len - i, &cp);
+            width += codepoint_width(cp);
+        }
     }
+    return width;
+}
 
-    printf("%s", RESTORE_CURSOR);
-    fflush(stdout);
+/* fills n more columns of a row, wrapping as the terminal would */
+static void layout_advance(struct layout *lay, uint64_t n, uint32_t cols)
+{
+    uint64_t filled = lay->col + n;
 
-    if (g_client_state.clear_mode) {
-        return;
+    if (filled > cols) {
+        lay->rows += (filled - 1) / cols;
+        lay->col = (filled - 1) % cols + 1;
+    } else {
+        lay->col = filled;
     }
+}
 
-    // navigate backwards to the beginning of what we want to print
-    iter = tail;
-    for (; count != 0; count--) {
-        printf("%s", LINE_UP);
-        if (iter->prev != NULL) {
-            iter = iter->prev;
+/* carries a layout across text printed at cols columns: auto-wrap at the right margin, a wide glyph
+ * that doesn't fit going to the next row whole, and embedded newlines. with stop_row set, returns the
+ * offset the text reaches that row at (len if it never does) */
+size_t layout_walk(struct layout *lay, const char *s, size_t len, uint32_t cols, uint32_t stop_row)
+{
+    size_t i = 0, n;
+    uint32_t cp;
+    int width;
+
+    while (i < len) {
+        n = ascii_run(s + i, len - i);
+        if (n > 0) {
+            /* the first wrap comes once the current row is full, then one every cols bytes */
+            if (stop_row && lay->col + n > cols && lay->rows + (lay->col + n - 1) / cols >= stop_row) {
+                i += (cols - lay->col) + (size_t)(stop_row - lay->rows - 1) * cols;
+                lay->rows = stop_row;
+                lay->col = 0;
+                return i;
+            }
+            layout_advance(lay, n, cols);
+            i += n;
+            continue;
         }
-    }
 
-    // print messages!
-    while (iter != NULL) {
-        localtime_r(&iter->msg.time, &timeinfo);
-        now_time = time(NULL);
-        localtime_r(&now_time, &now);
-        if (now.tm_year == timeinfo.tm_year &&
-                now.tm_mon == timeinfo.tm_mon &&
-                now.tm_mday == timeinfo.tm_mday) {
-            strftime(time_str, sizeof(time_str), "%T ", &timeinfo);
-        } else {
-            strftime(time_str, sizeof(time_str), "%a %T ", &timeinfo);
+        if (s[i] == '\n') {
+            lay->rows++;
+            lay->col = 0;
+            i++;
+            if (lay->rows == stop_row) {
+                return i;
+            }
+            continue;
         }
 
-        printf("%s", time_str);
-
-        switch (iter->msg.type) {
-        case MSG_NORMAL:
-            if (iter->msg.user_id == g_client_state.user_id) {
-                printf("%s", COLOR_CYAN);
-            } else {
-                printf("%s", COLOR_YELLOW);
+        n = utf8_decode(s + i, len - i, &cp);
+        width = codepoint_width(cp);
+        if (width > 0 && lay->col + width > cols) {
+            lay->rows++;
+            lay->col = 0;
+            if (lay->rows == stop_row) {
+                return i;
             }
+        }
+        lay->col += width;
+        i += n;
+    }
+    return len;
+}
+
+/* terminal width to lay out for; something sane when stdout isn't a terminal */
+static uint32_t screen_cols(void)
+{
+    return w.ws_col >= 2 ? w.ws_col : 80;
+}
+
+/* formats the timestamp an entry is printed under, and returns the width of everything printed before
+ * its text */
+static uint32_t node_prefix(struct node *node, char *time_str, size_t size)
+{
+    struct tm timeinfo;
+    struct tm now;
+    time_t now_time;
+    uint32_t width;
+
+    localtime_r(&node->msg.time, &timeinfo);
+    now_time = time(NULL);
+    localtime_r(&now_time, &now);
+    if (now.tm_year == timeinfo.tm_year &&
+            now.tm_mon == timeinfo.tm_mon &&
+            now.tm_mday == timeinfo.tm_mday) {
+        strftime(time_str, size, "%T ", &timeinfo);
+    } else {
+        strftime(time_str, size, "%a %T ", &timeinfo);
+    }
+
+    width = strlen(time_str);
+    if (node->msg.type == MSG_NORMAL) {
+        width += utf8_width(node->msg.nick, strnlen(node->msg.nick, NICK_SIZE)) + 2;
+    }
+    return width;
+}
+
+/* rows an entry takes at cols columns. the walk over its text happens once per terminal width (or
+ * when the timestamp changes format at midnight); after that it's a lookup. the walk also notes where
+ * every LAYOUT_MARK_ROWS-th row starts, so print_node() can seek into a tall entry */
+uint32_t node_rows(struct node *node, uint32_t cols)
+{
+    char time_str[BUF_SIZE];
+    struct layout lay = { 1, 0 };
+    uint32_t prefix = node_prefix(node, time_str, sizeof(time_str));
+    uint32_t stop = LAYOUT_MARK_ROWS + 1, max_marks = 0;
+    const char *text;
+    size_t len, off = 0;
+
+    if (node->layout_cols == cols && node->layout_prefix == prefix) {
+        return node->layout_rows;
+    }
+
+    text = node_text(node);
+    len = strlen(text);
+    layout_advance(&lay, prefix, cols);
+    free(node->layout_marks);
+    node->layout_marks = NULL;
+    node->layout_num_marks = 0;
+    if (lay.rows >= stop) {
+        /* a terminal too narrow for the prefix; not worth seeking in */
+        stop = 0;
+    }
+
+    while (1) {
+        off += layout_walk(&lay, text + off, len - off, cols, stop);
+        if (stop == 0 || lay.rows < stop) {
+            break;
+        }
+        if (node->layout_num_marks == max_marks) {
+            max_marks = max_marks ? max_marks * 2 : 16;
+            node->layout_marks = realloc(node->layout_marks, max_marks * sizeof(uint32_t));
+            if (node->layout_marks == NULL) {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        node->layout_marks[node->layout_num_marks++] = off;
+        stop += LAYOUT_MARK_ROWS;
+    }
+
+    node->layout_cols = cols;
+    node->layout_prefix = prefix;
+    node->layout_rows = lay.rows;
+    node->layout_len = len;
+    return lay.rows;
+}
+
+/* prints text from off, with the node's highlight matches picked out. the escapes take no columns, so
+ * the layout doesn't change */
+static void print_spans(struct node *node, const char *text, size_t off)
+{
+    const struct span *span = node->spans, *end = node->spans + node->num_spans;
+    size_t start;
+
+    while (span < end && span->end <= off) {
+        span++;
+    }
+    for (; span < end; span++) {
+        start = span->start > off ? span->start : off;
+        printf("%.*s%s%.*s%s", (int)(start - off), text + off, HIGHLIGHT_ON, (int)(span->end - start),
+            text + start, HIGHLIGHT_OFF);
+        off = span->end;
+    }
+    printf("%s", text + off);
+}
+
+/* prints an entry from the cursor, leaving off its first skip_rows rows. the cursor must be at the
+ * start of a cleared row, with node_rows() rows below it */
+static void print_node(struct node *node, uint32_t skip_rows, uint32_t cols)
+{
+    char time_str[BUF_SIZE];
+    struct layout lay = { 1, 0 };
+    uint32_t prefix = node_prefix(node, time_str, sizeof(time_str));
+    const char *text = node_text(node);
+    uint32_t mark;
+    size_t off = 0;
+
+    if (skip_rows == 0) {
+        printf("%s", time_str);
+    } else {
+        /* start from the last noted row at or above the first one shown, so scrolling inside a huge
+         * paste only walks the rows in between */
+        node_rows(node, cols);
+        layout_advance(&lay, prefix, cols);
+        mark = skip_rows / LAYOUT_MARK_ROWS;
+        if (mark > node->layout_num_marks) {
+            mark = node->layout_num_marks;
+        }
+        if (mark > 0) {
+            lay.rows = mark * LAYOUT_MARK_ROWS + 1;
+            lay.col = 0;
+            off = node->layout_marks[mark - 1];
+        }
+        if (lay.rows <= skip_rows) {
+            off += layout_walk(&lay, text + off, node->layout_len - off, cols, skip_rows + 1);
+        }
+    }
+
+    switch (node->msg.type) {
+    case MSG_NORMAL:
+        if (node->msg.user_id == g_client_state.user_id) {
+            printf("%s", COLOR_CYAN);
+        } else {
+            printf("%s", COLOR_YELLOW);
+        }
+        break;
+    default:
+        printf("%s", COLOR_NONE);
+        break;
+
+    }
+
+    if (node->msg.type == MSG_NORMAL && skip_rows == 0) {
+        printf("%s: ", node->msg.nick);
+    }
+    print_spans(node, text, off);
+
+    printf("%s", COLOR_NONE);
+}
+
+/* the entries being drawn, newest first */
+static struct node *g_visible[MAX_DISPLAY_MESSAGES];
+
+/* draws the first count entries of g_visible (used rows between them) bottom-aligned in the rows rows
+ * starting at top_row. when they don't all fit, the oldest is cut off at the top */
+static void draw_visible(uint32_t count, uint32_t used, uint32_t top_row, uint32_t rows, uint32_t cols)
+{
+    uint32_t skip = used > rows ? used - rows : 0;
+    uint32_t row = top_row + (used < rows ? rows - used : 0);
+    struct node *node;
+
+    while (count > 0) {
+        node = g_visible[--count];
+        printf(CURSOR_TO_ROW_FORMAT, row);
+        print_node(node, skip, cols);
+        row += node->layout_rows - skip;
+        skip = 0;
+    }
+}
+
+/* shows the newest search results that fit, under a summary line */
+static void display_search(uint32_t rows, uint32_t cols)
+{
+    struct node *node;
+    uint32_t count = 0, used = 0, i = g_search.count;
+
+    printf(CURSOR_TO_ROW_FORMAT, 1);
+    printf("%s%u matches for \"%s\" (%.2fms; '%c' to close)%s", COLOR_GREEN, g_search.total, g_search.query,
+        g_search.elapsed_ns / 1e6, UI_SEARCH_CMD, COLOR_NONE);
+    if (rows < 2) {
+        return;
+    }
+
+    /* results deleted since the search just drop out */
+    while (i > 0 && used < rows - 1 && count < MAX_DISPLAY_MESSAGES) {
+        node = history_lookup(g_search.ids[--i]);
+        if (node) {
+            g_visible[count++] = node;
+            used += node_rows(node, cols);
+        }
+    }
+    draw_visible(count, used, 2, rows - 1, cols);
+}
+
+/* redraws the rows above the input bar. only the entries that end up on screen get looked at (and laid
+ * out, if the width changed), so this is O(rows) however long the history or its messages are */
+void update_display(void)
+{
+    uint32_t rows = w.ws_row > 1 ? w.ws_row - 1 : 1;
+    uint32_t cols = screen_cols();
+    uint32_t count = 0, used = 0, row;
+    struct node *iter;
+
+    // save cursor
+    printf("%s", SAVE_CURSOR);
+
+    // clear screen (skipping input bar)
+    for (row = 1; row <= rows; row++) {
+        printf(CURSOR_TO_ROW_FORMAT, row);
+        printf("%s", CLEAR_LINE);
+    }
+
+    if (g_search.active) {
+        display_search(rows, cols);
+    } else if (!g_client_state.clear_mode) {
+        // find what fits above the input bar, ending at the bottom of the view
+        iter = g_view.bottom ? g_view.bottom : tail;
+        while (iter != NULL && used < rows && count < MAX_DISPLAY_MESSAGES) {
+            g_visible[count++] = iter;
+            used += node_rows(iter, cols);
+            iter = iter->prev;
+        }
+        draw_visible(count, used, 1, rows, cols);
+    }
+
+    //restore cursor
+    printf("%s", RESTORE_CURSOR);
+    fflush(stdout);
+}
+
+/* caller must hold msg_mutex */
+void follow_view(void)
+{
+    g_view.bottom = NULL;
+    g_view.new_below = 0;
+}
+
+/* message rows above the input bar */
+static uint32_t visible_rows(void)
+{
+    uint32_t rows = w.ws_row > 1 ? w.ws_row - 1 : 1;
+
+    return rows < MAX_DISPLAY_MESSAGES ? rows : MAX_DISPLAY_MESSAGES;
+}
+
+/* the last entry that still fits on screen with top at the top */
+static struct node *fill_from(struct node *top, uint32_t visible, uint32_t cols)
+{
+    uint32_t used = node_rows(top, cols);
+
+    while (top->next && used + node_rows(top->next, cols) <= visible) {
+        top = top->next;
+        used += top->layout_rows;
+    }
+    return top;
+}
+
+static void set_view_bottom(struct node *bottom)
+{
+    if (bottom == tail) {
+        follow_view();
+    } else {
+        if (g_view.bottom == NULL) {
+            g_view.new_below = 0;
+        }
+        g_view.bottom = bottom;
+    }
+}
+
+/* the entry that ends at least `steps` screen rows below bottom, or the newest one */
+static struct node *rows_below(struct node *bottom, uint64_t steps, uint32_t cols)
+{
+    uint64_t moved = 0;
+
+    while (moved < steps && bottom->next) {
+        bottom = bottom->next;
+        moved += node_rows(bottom, cols);
+    }
+    return bottom;
+}
+
+/* rows one PgUp/PgDn moves: a screen less a row of overlap */
+static uint32_t page_rows(uint32_t visible)
+{
+    return visible > 1 ? visible - 1 : 1;
+}
+
+/* moves the view by whole screens (less a row of overlap); negative is back in time. counts screen rows,
+ * so wrapped messages page correctly, and only touches entries it scrolls past: O(rows) no matter how
+ * deep the history is. caller must hold msg_mutex */
+void scroll_view(int pages)
+{
+    struct node *bottom = g_view.bottom ? g_view.bottom : tail;
+    struct node *iter;
+    uint32_t cols = screen_cols();
+    uint32_t visible = visible_rows();
+    uint64_t steps = (uint64_t)abs(pages) * page_rows(visible);
+    uint64_t moved = 0, above;
+
+    if (bottom == NULL) {
+        return;
+    }
+
+    if (pages < 0) {
+        while (moved < steps && bottom->prev) {
+            moved += node_rows(bottom, cols);
+            bottom = bottom->prev;
+        }
+        above = node_rows(bottom, cols);
+        for (iter = bottom; above < visible && iter->prev; ) {
+            iter = iter->prev;
+            above += node_rows(iter, cols);
+        }
+        if (above < visible) {
+            /* that's the first page; fill it from the oldest message */
+            bottom = fill_from(root, visible, cols);
+        }
+    } else {
+        bottom = rows_below(bottom, steps, cols);
+    }
+
+    set_view_bottom(bottom);
+}
+
+/* puts the mark at the top of the screen. caller must hold msg_mutex */
+void jump_to_mark(void)
+{
+    if (g_mark == NULL) {
+        add_info_message("no mark set ('%c' sets one)", UI_MARK_CMD);
+        follow_view();
+        return;
+    }
+
+    set_view_bottom(fill_from(g_mark, visible_rows(), screen_cols()));
+}
+
+/* seeks to a page (1 is the oldest): the screen PgDn reaches after page - 1 presses from the top of the
+ * history, counted in rendered rows the same way scroll_view() counts them. finds both ends through
+ * g_rows, so O(log n) however deep the history is, plus an O(n) layout of it the first time and after
+ * a resize or midnight. caller must hold msg_mutex */
+void goto_page(long page)
+{
+    uint32_t cols = screen_cols();
+    uint32_t visible = visible_rows();
+    uint64_t steps;
+    struct node *first, *bottom;
+
+    if (page < 1 || root == NULL) {
+        return;
+    }
+    if (g_rows.cols != cols || g_rows.day != day_number()) {
+        rows_build(cols);
+    }
+
+    /* page 1 ends just before the entry holding its first row too many, like fill_from(root) */
+    first = rows_find(visible);
+    first = first == NULL ? tail : first == root ? root : first->prev;
+    /* and page p ends at the first entry at least that many rows further on, like rows_below() */
+    steps = (uint64_t)page_rows(visible) * (page - 1);
+    if ((uint64_t)(page - 1) >= rows_upto(g_rows.size)) {
+        bottom = tail;
+    } else if (steps == 0) {
+        bottom = first;
+    } else if ((bottom = rows_find(rows_upto(first->id - g_rows.base + 1) + steps - 1)) == NULL) {
+        bottom = tail;
+    }
+
+    set_view_bottom(bottom);
+}
+
+static int page_key(int pages)
+{
+    pthread_mutex_lock(&msg_mutex);
+    scroll_view(pages);
+    update_display();
+    update_prompt();
+    rl_redisplay();
+    pthread_mutex_unlock(&msg_mutex);
+
+    return 0;
+}
+
+int page_up_key(int count, int key)
+{
+    (void)key;
+    return page_key(-count);
+}
+
+int page_down_key(int count, int key)
+{
+    (void)key;
+    return page_key(count);
+}
+
+int redact_message(int user_id)
+{
+    struct node *iter;
+    int found =  0;
+
+    if (!tail) {
+        return found;
+    }
+
+    iter = tail;
+    while (iter) {
+        if (iter->msg.user_id == user_id && iter->msg.type == MSG_NORMAL) {
+            delete_node(iter);
+            iter = NULL;
+            found = 1;
+        } else {
+            iter = iter->prev;
+        }
+    }
+
+    if (found) {
+        update_display();
+    }
+
+    return found;
+}
+
+void window_resized(int signum)
+{
+    pthread_mutex_lock(&msg_mutex);
+    clear_display();
+    update_display();
+    rl_redisplay();
+    pthread_mutex_unlock(&msg_mutex);
+}
+
+/* adds a local-only line to the history. caller must hold msg_mutex */
+void add_info_message(const char *fmt, ...)
+{
+    struct msg msg = {0};
+    va_list ap;
+
+    msg.type = MSG_INFO;
+    msg.time = time(NULL);
+    msg.user_id = -1;
+    va_start(ap, fmt);
+    vsnprintf(msg.msg, sizeof(msg.msg), fmt, ap);
+    va_end(ap);
+    add_new_message(&msg);
+}
+
+static void format_ns(char *buf, size_t len, uint64_t ns)
+{
+    if (ns < 1000ULL) {
+        snprintf(buf, len, "%luns", (unsigned long)ns);
+    } else if (ns < 1000000ULL) {
+        snprintf(buf, len, "%.1fus", ns / 1e3);
+    } else if (ns < 1000000000ULL) {
+        snprintf(buf, len, "%.1fms", ns / 1e6);
+    } else {
+        snprintf(buf, len, "%.2fs", ns / 1e9);
+    }
+}
+
+/* called once a traced message has been rendered. caller must hold msg_mutex */
+void record_trace(struct msg *msg)
+{
+    struct trace_record *rec;
+    uint64_t total;
+    int i, bucket;
+
+    for (i = 0; i < TRACE_NUM_HOPS; i++) {
+        if (msg->trace[i] == 0) {
+            /* sender didn't trace this message, or it was stamped by a server that doesn't */
+            return;
+        }
+    }
+
+    for (i = 1; i < TRACE_NUM_HOPS; i++) {
+        g_latency.hop_total[i] += msg->trace[i] - msg->trace[i-1];
+    }
+
+    total = msg->trace[TRACE_RENDER_DONE] - msg->trace[TRACE_CLIENT_SEND];
+    bucket = total ? 63 - __builtin_clzll(total) : 0;
+    if (bucket >= LATENCY_BUCKETS) {
+        bucket = LATENCY_BUCKETS - 1;
+    }
+    g_latency.buckets[bucket]++;
+    g_latency.count++;
+
+    rec = &g_latency.ring[g_latency.ring_next++ % TRACE_RING_SIZE];
+    rec->user_id = msg->user_id;
+    memcpy(rec->nick, msg->nick, NICK_SIZE);
+    memcpy(rec->trace, msg->trace, sizeof(rec->trace));
+}
+
+/* caller must hold msg_mutex */
+void show_latency(void)
+{
+    static const char *hop_names[TRACE_NUM_HOPS] = {
+        "", "send->server", "server->fanout", "fanout->recv", "recv->render"
+    };
+    char lo[BUF_SIZE], hi[BUF_SIZE], line[BUF_SIZE];
+    uint64_t max = 0;
+    int i, len;
+
+    if (g_latency.count == 0) {
+        add_info_message("latency: no traced messages yet (tracing is %s, toggle with '%c')",
+            g_client_state.trace_mode ? "on" : "off", UI_TRACE_TOGGLE_CMD);
+        return;
+    }
+
+    len = snprintf(line, sizeof(line), "latency: %lu traced messages, mean",
+        (unsigned long)g_latency.count);
+    for (i = 1; i < TRACE_NUM_HOPS; i++) {
+        format_ns(lo, sizeof(lo), g_latency.hop_total[i] / g_latency.count);
+        len += snprintf(line + len, sizeof(line) - len, " %s %s", hop_names[i], lo);
+    }
+    add_info_message("%s", line);
+
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        if (g_latency.buckets[i] > max) {
+            max = g_latency.buckets[i];
+        }
+    }
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        if (g_latency.buckets[i] == 0) {
+            continue;
+        }
+        format_ns(lo, sizeof(lo), 1ULL << i);
+        format_ns(hi, sizeof(hi), 1ULL << (i + 1));
+        len = snprintf(line, sizeof(line), "  %8s - %-8s %8lu ", lo, hi,
+            (unsigned long)g_latency.buckets[i]);
+        memset(line + len, '#', 1 + 39 * g_latency.buckets[i] / max);
+        line[len + 1 + 39 * g_latency.buckets[i] / max] = '\0';
+        add_info_message("%s", line);
+    }
+}
+
+/* caller must hold msg_mutex */
+void export_trace(void)
+{
+    char path[BUF_SIZE];
+    struct trace_record *rec;
+    uint32_t i, start, count;
+    FILE *fp;
+    int j;
+
+    snprintf(path, sizeof(path), TRACE_FILE_FORMAT, (int)getpid());
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        add_info_message("trace export failed: %s: %s", path, strerror(errno));
+        return;
+    }
+
+    fprintf(fp, "user_id,nick,client_send,server_recv,server_fanout,client_recv,render_done\n");
+    count = g_latency.ring_next < TRACE_RING_SIZE ? g_latency.ring_next : TRACE_RING_SIZE;
+    start = g_latency.ring_next - count;
+    for (i = 0; i < count; i++) {
+        rec = &g_latency.ring[(start + i) % TRACE_RING_SIZE];
+        fprintf(fp, "%d,%s", rec->user_id, rec->nick);
+        for (j = 0; j < TRACE_NUM_HOPS; j++) {
+            fprintf(fp, ",%lu", (unsigned long)rec->trace[j]);
+        }
+        fprintf(fp, "\n");
+    }
+    fclose(fp);
+
+    add_info_message("exported %u traces to %s", count, path);
+}
+
+static inline unsigned char fold_byte(unsigned char c)
+{
+    return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static inline int is_word_byte(unsigned char c)
+{
+    return isalnum(c) || c == '_';
+}
+
+static int32_t matcher_new_state(struct matcher *m)
+{
+    struct ac_state *state;
+
+    if (m->num_states == m->cap) {
+        m->cap = m->cap ? m->cap * 2 : 64;
+        m->states = realloc(m->states, m->cap * sizeof(struct ac_state));
+        if (m->states == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    state = &m->states[m->num_states];
+    memset(state->next, -1, sizeof(state->next));
+    state->fail = 0;
+    state->pattern = -1;
+    state->out_link = -1;
+
+    return m->num_states++;
+}
+
+void matcher_free(struct matcher *m)
+{
+    free(m->states);
+    free(m->pattern_len);
+    free(m->pattern_edges);
+    memset(m, 0, sizeof(*m));
+}
+
+/* builds the trie, then fills in failure links breadth first, turning every missing transition into
+ * the one its failure state would take */
+void matcher_build(struct matcher *m, const char **patterns, uint32_t num_patterns)
+{
+    int32_t *queue;
+    uint32_t head = 0, queued = 0, i;
+    int32_t s, t, f;
+    size_t len, j;
+    int c;
+
+    matcher_free(m);
+    m->pattern_len = malloc(num_patterns * sizeof(uint32_t) + 1);
+    m->pattern_edges = malloc(num_patterns + 1);
+    if (m->pattern_len == NULL || m->pattern_edges == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    matcher_new_state(m);
+
+    for (i = 0; i < num_patterns; i++) {
+        len = strlen(patterns[i]);
+        if (len == 0) {
+            continue;
+        }
+        for (s = 0, j = 0; j < len; j++) {
+            c = fold_byte(patterns[i][j]);
+            if (m->states[s].next[c] < 0) {
+                t = matcher_new_state(m);
+                m->states[s].next[c] = t;
+            }
+            s = m->states[s].next[c];
+        }
+        if (m->states[s].pattern < 0 || m->pattern_len[m->states[s].pattern] < len) {
+            m->states[s].pattern = m->num_patterns;
+        }
+        m->pattern_len[m->num_patterns] = len;
+        m->pattern_edges[m->num_patterns] = is_word_byte(patterns[i][0]) |
+            is_word_byte(patterns[i][len - 1]) << 1;
+        m->num_patterns++;
+    }
+
+    queue = malloc(m->num_states * sizeof(int32_t));
+    if (queue == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (c = 0; c < 256; c++) {
+        t = m->states[0].next[c];
+        if (t < 0) {
+            m->states[0].next[c] = 0;
+        } else {
+            queue[queued++] = t;
+        }
+    }
+    while (head < queued) {
+        s = queue[head++];
+        f = m->states[s].fail;
+        m->states[s].out_link = m->states[f].pattern >= 0 ? f : m->states[f].out_link;
+        for (c = 0; c < 256; c++) {
+            t = m->states[s].next[c];
+            if (t < 0) {
+                m->states[s].next[c] = m->states[f].next[c];
+            } else {
+                m->states[t].fail = m->states[f].next[c];
+                queue[queued++] = t;
+            }
+        }
+    }
+    free(queue);
+}
+
+static int span_cmp(const void *a, const void *b)
+{
+    const struct span *x = a, *y = b;
+
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* finds whole-word matches of any pattern in text. fills in up to max_spans of them, sorted with overlaps
+ * merged, and returns how many that is */
+uint32_t matcher_find(const struct matcher *m, const char *text, size_t len, struct span *spans, uint32_t max_spans)
+{
+    const struct ac_state *states = m->states;
+    uint32_t count = 0, merged, i;
+    int32_t s = 0, out, p;
+    size_t pos, start;
+
+    if (m->num_patterns == 0) {
+        return 0;
+    }
+
+    for (pos = 0; pos < len && count < max_spans; pos++) {
+        s = states[s].next[fold_byte(text[pos])];
+        out = states[s].pattern >= 0 ? s : states[s].out_link;
+        for (; out >= 0 && count < max_spans; out = states[out].out_link) {
+            p = states[out].pattern;
+            start = pos + 1 - m->pattern_len[p];
+            /* a word in the pattern has to be a word in the text, not part of a longer one */
+            if ((m->pattern_edges[p] & 1) && start > 0 && is_word_byte(text[start - 1])) {
+                continue;
+            }
+            if ((m->pattern_edges[p] & 2) && pos + 1 < len && is_word_byte(text[pos + 1])) {
+                continue;
+            }
+            spans[count].start = start;
+            spans[count].end = pos + 1;
+            count++;
+        }
+    }
+
+    if (count < 2) {
+        return count;
+    }
+    qsort(spans, count, sizeof(struct span), span_cmp);
+    for (merged = 0, i = 1; i < count; i++) {
+        if (spans[i].start <= spans[merged].end) {
+            if (spans[i].end > spans[merged].end) {
+                spans[merged].end = spans[i].end;
+            }
+        } else {
+            spans[++merged] = spans[i];
+        }
+    }
+    return merged + 1;
+}
+
+static int rule_cmp(const void *a, const void *b)
+{
+    return strcasecmp(*(char * const *)a, *(char * const *)b);
+}
+
+static char **rule_list_find(const struct rule_list *list, const char *item)
+{
+    if (list->count == 0) {
+        return NULL;
+    }
+    return bsearch(&item, list->items, list->count, sizeof(char *), rule_cmp);
+}
+
+/* returns 0 if it was already there */
+static int rule_list_add(struct rule_list *list, const char *item)
+{
+    uint32_t i;
+
+    if (rule_list_find(list, item)) {
+        return 0;
+    }
+    if (list->count == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 16;
+        list->items = realloc(list->items, list->cap * sizeof(char *));
+        if (list->items == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (i = list->count; i > 0 && strcasecmp(list->items[i - 1], item) > 0; i--) {
+        list->items[i] = list->items[i - 1];
+    }
+    list->items[i] = strdup(item);
+    list->count++;
+
+    return 1;
+}
+
+/* returns 0 if it wasn't there */
+static int rule_list_remove(struct rule_list *list, const char *item)
+{
+    char **found = rule_list_find(list, item);
+    uint32_t i;
+
+    if (found == NULL) {
+        return 0;
+    }
+    free(*found);
+    i = found - list->items;
+    memmove(found, found + 1, (list->count - i - 1) * sizeof(char *));
+    list->count--;
+
+    return 1;
+}
+
+/* recompiles the matcher after the keywords or our nick change */
+void highlight_rebuild(void)
+{
+    const char **patterns = malloc((g_highlight.keywords.count + 1) * sizeof(char *));
+    uint32_t n = 0;
+
+    if (patterns == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    if (g_client_state.nick[0]) {
+        patterns[n++] = g_client_state.nick;
+    }
+    memcpy(patterns + n, g_highlight.keywords.items, g_highlight.keywords.count * sizeof(char *));
+    n += g_highlight.keywords.count;
+
+    matcher_build(&g_highlight.matcher, patterns, n);
+    free(patterns);
+}
+
+/* runs the rules over a new message from someone else. returns 1 if anything matched */
+int highlight_node(struct node *node)
+{
+    struct span spans[HIGHLIGHT_MAX_SPANS];
+    const char *text = node_text(node);
+    uint32_t count;
+
+    if (rule_list_find(&g_highlight.deny, node->msg.nick)) {
+        return 0;
+    }
+    count = matcher_find(&g_highlight.matcher, text, strlen(text), spans, HIGHLIGHT_MAX_SPANS);
+    if (count == 0) {
+        return 0;
+    }
+
+    node->spans = malloc(count * sizeof(struct span));
+    if (node->spans == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(node->spans, spans, count * sizeof(struct span));
+    node->num_spans = count;
+
+    return 1;
+}
+
+/* whether a message that was just added to history as node should alert the user */
+static int message_urgent(const struct msg *msg, const struct node *node)
+{
+    int from_other = msg->type == MSG_NORMAL && msg->user_id != g_client_state.user_id;
+
+    if (g_client_state.urgent_mode == URGENT_NONE || rule_list_find(&g_highlight.deny, msg->nick)) {
+        return 0;
+    }
+
+    switch (g_client_state.urgent_mode) {
+    case URGENT_ALL:
+        return 1;
+    case URGENT_MSG_ONLY:
+        return from_other;
+    case URGENT_HIGHLIGHT:
+        return from_other && (node->num_spans || rule_list_find(&g_highlight.allow, msg->nick));
+    default:
+        return 0;
+    }
+}
+
+static void list_rules(const char *what, const char *prefix, const struct rule_list *list)
+{
+    char buf[BUF_SIZE];
+    size_t len = 0;
+    uint32_t i;
+
+    for (i = 0; i < list->count && len < sizeof(buf); i++) {
+        len += snprintf(buf + len, sizeof(buf) - len, "%s%s%s", i ? " " : "", prefix, list->items[i]);
+    }
+    add_info_message("%s: %s", what, list->count ? buf : "(none)");
+}
+
+/* "k <word>", "k +<nick>", "k !<nick>", "k -<any of those>"; "k" alone lists the rules. new rules apply
+ * to messages from now on. caller must hold msg_mutex */
+void highlight_command(const char *args)
+{
+    struct rule_list *list = &g_highlight.keywords;
+    int removing = 0;
+
+    while (isspace((unsigned char)*args)) {
+        args++;
+    }
+    if (*args == '\0') {
+        list_rules("highlighted", "", &g_highlight.keywords);
+        list_rules("always alert", "+", &g_highlight.allow);
+        list_rules("never alert", "!", &g_highlight.deny);
+        add_info_message("alerting on %s ('%c' to change)", g_urgent_mode_names[g_client_state.urgent_mode],
+            UI_CYCLE_URGENT_MODE_CMD);
+        return;
+    }
+
+    if (*args == '-') {
+        removing = 1;
+        args++;
+    }
+    if (*args == '+') {
+        list = &g_highlight.allow;
+        args++;
+    } else if (*args == '!') {
+        list = &g_highlight.deny;
+        args++;
+    }
+    if (args[0] == '\0') {
+        return;
+    }
+    /* cutting it down would quietly make it a different rule */
+    if (list == &g_highlight.keywords && strlen(args) > HIGHLIGHT_MAX_KEYWORD) {
+        add_info_message("highlight keywords are at most %d bytes", HIGHLIGHT_MAX_KEYWORD);
+        return;
+    } else if (list != &g_highlight.keywords && strlen(args) > NICK_SIZE - 1) {
+        add_info_message("no nick is longer than %d bytes", NICK_SIZE - 1);
+        return;
+    }
+
+    if (removing) {
+        if (!rule_list_remove(list, args)) {
+            add_info_message("no rule \"%s\"", args);
+            return;
+        }
+    } else {
+        rule_list_add(list, args);
+    }
+    if (list == &g_highlight.keywords) {
+        highlight_rebuild();
+    }
+}
+
+/* returns PROCESS_REDRAW if the display needs to be updated, plus PROCESS_URGENT if the user should be
+ * alerted as well */
+int process_message(struct msg *msg)
+{
+    int urgent = g_client_state.urgent_mode == URGENT_ALL;
+
+    /* nothing another user sends gets to the terminal unsanitized. chunks can split a character, so
+     * their text waits until it's whole */
+    msg->nick[sanitize_text(msg->nick, strnlen(msg->nick, NICK_SIZE - 1), 0)] = '\0';
+    if (msg->type != MSG_CHUNK) {
+        msg->len = sanitize_text(msg->msg, msg->len, 1);
+        msg->msg[msg->len] = '\0';
+    }
+
+    switch(msg->type) {
+    case MSG_CHUNK:
+    case MSG_NORMAL:
+    case MSG_JOIN:
+    case MSG_CLEAR_HISTORY:
+    case MSG_QUIT:
+    case MSG_RENAME:
+        if (msg->type == MSG_CHUNK) {
+            if (!process_chunk(msg)) {
+                /* still waiting for the rest of it */
+                return 0;
+            }
+        } else {
+            add_new_message(msg);
+        }
+        if ((msg->type == MSG_JOIN || msg->type == MSG_RENAME) && msg->user_id == g_client_state.user_id) {
+            /* our own nick is always highlighted */
+            memcpy(g_client_state.nick, msg->nick, NICK_SIZE);
+            highlight_rebuild();
+        }
+        if (msg->type == MSG_NORMAL && msg->user_id != g_client_state.user_id) {
+            highlight_node(tail);
+        }
+        urgent = message_urgent(msg, tail);
+        /* whatever they were typing, they're done */
+        set_typing(msg->user_id, msg->nick, TYPING_END_CMD);
+        if (msg->type == MSG_QUIT) {
+            /* they won't be finishing anything they were sending */
+            release_reassembly(msg->user_id);
+        }
+        if (g_client_state.clear_mode && msg->user_id != g_client_state.user_id) {
+            g_client_state.num_pending_msg++;
+            update_prompt();
+            rl_redisplay();
+        }
+        break;
+    case MSG_REDACT:
+        if (redact_message(msg->user_id)) {
+            if (g_client_state.num_pending_msg > 0 && msg->user_id != g_client_state.user_id) {
+                g_client_state.num_pending_msg--;
+                update_prompt();
+                rl_redisplay();
+            }
+        }
+        break;
+    case MSG_RENAME_REJECTED:
+        add_info_message("can't change nick to \"%s\": invalid or taken", msg->nick);
+        break;
+    case MSG_TYPING:
+        set_typing(msg->user_id, msg->nick, msg->msg[0]);
+        return 0;
+    case MSG_RATE_LIMITED:
+    case MSG_STATS:
+        add_info_message("%s", msg->msg);
+        break;
+    default:
+        /* ??? */
+        break;
+    }
+
+    return PROCESS_REDRAW | (urgent ? PROCESS_URGENT : 0);
+}
+
+/* doubles a table of per-user slots (MAX_USERS to start with) and returns it. the new slots are zeroed,
+ * which leaves them free; the first of them is at the old *cap */
+static void *grow_user_slots(void *slots, uint32_t *cap, size_t size)
+{
+    uint32_t old_cap = *cap;
+
+    *cap = old_cap ? old_cap * 2 : MAX_USERS;
+    slots = realloc(slots, *cap * size);
+    if (slots == NULL) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+    }
+    memset((char *)slots + old_cap * size, 0, (*cap - old_cap) * size);
+
+    return slots;
+}
+
+/* comma-separated nicks of users in the given typing state. returns the length */
+static int list_typing(char *buf, size_t size, char state)
+{
+    int len = 0;
+
+    buf[0] = '\0';
+    for (uint32_t i = 0; i < g_typing_users_cap && len < (int)size; i++) {
+        if (g_typing_users[i].user_id && g_typing_users[i].state == state) {
+            len += snprintf(buf + len, size - len, "%s%s", len ? ", " : "", g_typing_users[i].nick);
+        }
+    }
+
+    return len;
+}
+
+/* caller must hold msg_mutex */
+void update_title(void)
+{
+    char title[BUF_SIZE];
+    size_t len = 0;
+
+    /* unseen alerts go in front of whatever else it says */
+    if (g_client_state.num_urgent) {
+        len = snprintf(title, sizeof(title), URGENT_TITLE_FORMAT, g_client_state.num_urgent);
+    }
+
+    if (list_typing(title + len, sizeof(title) - len, TYPING_START_CMD)) {
+        printf(CHANGE_TITLE_IS_TYPING_FORMAT, title);
+    } else if (list_typing(title + len, sizeof(title) - len, TYPING_STALLED_CMD)) {
+        printf(CHANGE_TITLE_PAUSED_FORMAT, title);
+    } else {
+        snprintf(title + len, sizeof(title) - len, "%s", TITLE_DEFAULT);
+        printf(CHANGE_TITLE_FORMAT, title);
+    }
+    fflush(stdout);
+}
+
+/* records another user's typing state and retitles if it changed. caller must hold msg_mutex */
+void set_typing(int user_id, const char *nick, char state)
+{
+    struct typing_user *slot = NULL, *free_slot = NULL;
+    uint32_t i;
+
+    if (user_id == g_client_state.user_id) {
+        return;
+    }
+    for (i = 0; i < g_typing_users_cap; i++) {
+        if (g_typing_users[i].user_id == user_id) {
+            slot = &g_typing_users[i];
             break;
-        default:
-            printf("%s", COLOR_NONE);
-            break;
+        }
+        if (free_slot == NULL && g_typing_users[i].user_id == 0) {
+            free_slot = &g_typing_users[i];
+        }
+    }
 
+    if (state != TYPING_START_CMD && state != TYPING_STALLED_CMD) {
+        if (slot) {
+            memset(slot, 0, sizeof(struct typing_user));
+            update_title();
         }
+        return;
+    }
 
-        if (iter->msg.type == MSG_NORMAL) {
-            printf("%s: %s", iter->msg.nick, iter->msg.msg);
-        } else if (iter->msg.msg[0]) {
-            printf("%s", iter->msg.msg);
+    if (slot == NULL) {
+        if (free_slot == NULL) {
+            i = g_typing_users_cap;
+            g_typing_users = grow_user_slots(g_typing_users, &g_typing_users_cap, sizeof(struct typing_user));
+            free_slot = &g_typing_users[i];
         }
+        slot = free_slot;
+        slot->user_id = user_id;
+    }
+    slot->seen_ns = now_ns();
+    if (slot->state == state && strncmp(slot->nick, nick, NICK_SIZE) == 0) {
+        /* still the same; they're just saying so again */
+        return;
+    }
+    slot->state = state;
+    snprintf(slot->nick, NICK_SIZE, "%s", nick);
+    update_title();
+}
 
-        printf("%s\n", COLOR_NONE) ;
+/* drops typing states nobody has repeated for TYPING_TIMEOUT_MS; whoever it was went quiet without an
+ * end (or a goodbye) reaching us. caller must hold msg_mutex */
+static void expire_typing(uint64_t now)
+{
+    int changed = 0;
 
-        iter = iter->next;
+    for (uint32_t i = 0; i < g_typing_users_cap; i++) {
+        if (g_typing_users[i].user_id && now - g_typing_users[i].seen_ns > TYPING_TIMEOUT_MS * 1000000ULL) {
+            memset(&g_typing_users[i], 0, sizeof(struct typing_user));
+            changed = 1;
+        }
+    }
+    if (changed) {
+        update_title();
     }
-
-    //restore cursor
-    printf("%s", RESTORE_CURSOR);
-    fflush(stdout);
 }
 
-int redact_message(int user_id)
+/* readline event hook; runs every ~100ms while readline waits for a key. sends our typing state when it
+ * changes, at most once per TYPING_INTERVAL_MS, and again every TYPING_REFRESH_MS while it holds so the
+ * others don't time it out. a state that flips back within the interval is never sent */
+int typing_event_hook(void)
 {
-    struct node *iter;
-    int found =  0;
+    struct msg msg = {0};
+    uint64_t now = now_ns();
+    char state;
 
-    if (!tail) {
-        return found;
+    if (now - g_typing.expired_ns >= TYPING_INTERVAL_MS * 1000000ULL) {
+        pthread_mutex_lock(&msg_mutex);
+        expire_typing(now);
+        pthread_mutex_unlock(&msg_mutex);
+        g_typing.expired_ns = now;
     }
 
-    iter = tail;
-    while (iter) {
-        if (iter->msg.user_id == user_id && iter->msg.type == MSG_NORMAL) {
-            delete_node(iter);
-            iter = NULL;
-            found = 1;
-        } else {
-            iter = iter->prev;
-        }
+    if (rl_end != g_typing.edit_end || rl_point != g_typing.edit_point) {
+        g_typing.edit_end = rl_end;
+        g_typing.edit_point = rl_point;
+        g_typing.last_edit_ns = now;
     }
 
-    if (found) {
-        update_display();
+    if (rl_end == 0) {
+        state = TYPING_END_CMD;
+    } else if (now - g_typing.last_edit_ns > TYPING_STALL_MS * 1000000ULL) {
+        state = TYPING_STALLED_CMD;
+    } else {
+        state = TYPING_START_CMD;
     }
 
-    return found;
-}
+    if (now - g_typing.sent_ns < TYPING_INTERVAL_MS * 1000000ULL) {
+        return 0;
+    }
+    if (state == g_typing.sent &&
+            (state == TYPING_END_CMD || now - g_typing.sent_ns < TYPING_REFRESH_MS * 1000000ULL)) {
+        return 0;
+    }
 
-void window_resized(int signum)
-{
-    pthread_mutex_lock(&msg_mutex);
-    clear_display();
-    update_display();
-    rl_redisplay();
-    pthread_mutex_unlock(&msg_mutex);
+    msg.type = MSG_TYPING;
+    msg.time = time(NULL);
+    msg.msg[0] = state;
+    send_msg(g_typing.fd, &msg);
+    g_typing.sent = state;
+    g_typing.sent_ns = now;
+
+    return 0;
 }
 
-void process_message(struct msg *msg)
+/* user_id 0 finds a free slot */
+static struct reassembly *find_reassembly(int user_id)
 {
-    switch(msg->type) {
-    case MSG_NORMAL:
-    case MSG_JOIN:
-    case MSG_CLEAR_HISTORY:
-    case MSG_QUIT:
-        add_new_message(msg);
-        if (g_client_state.clear_mode && msg->user_id != g_client_state.user_id) {
-            g_client_state.num_pending_msg++;
-            update_prompt();
-            rl_redisplay();
-        }
-        break;
-    case MSG_REDACT:
-        if (redact_message(msg->user_id)) {
-            if (g_client_state.num_pending_msg > 0 && msg->user_id != g_client_state.user_id) {
-                g_client_state.num_pending_msg--;
-                update_prompt();
-                rl_redisplay();
-            }
+    for (uint32_t i = 0; i < g_reassembly_cap; i++) {
+        if (g_reassembly[i].user_id == user_id) {
+            return &g_reassembly[i];
         }
-    default:
-        /* ??? */
-        break;
     }
+
+    return NULL;
 }
 
-void * server_thread(void *arg)
+void release_reassembly(int user_id)
 {
-    int fd, client_fd;
-    struct sockaddr_un client_sock;
-    struct sockaddr_un *sock = (struct sockaddr_un *)arg;
-    socklen_t client_sock_len;
-    struct pollfd fds[MAX_USERS+1];
-    int num_fds;
-    int flags;
-    struct nick_entry {
-        int fd;
-        char nick[NICK_SIZE];
-    };
-    char nicks[MAX_USERS+1][NICK_SIZE];
+    struct reassembly *slot = find_reassembly(user_id);
 
-    memset(fds, 0, sizeof(fds));
-    memset(nicks, 0, sizeof(nicks));
+    if (slot == NULL) {
+        return;
+    }
 
-    fd = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (fd < 0) {
-        perror("socket");
-        exit(EXIT_FAILURE);
+    g_reassembly_bytes -= slot->total;
+    free(slot->buf);
+    memset(slot, 0, sizeof(struct reassembly));
+}
+
+static void set_recv_progress(uint32_t received, uint32_t total)
+{
+    uint8_t progress = 0;
+
+    if (total && received < total) {
+        progress = (uint64_t)received * 100 / total;
+        progress = progress ? progress : 1;
+    }
+    if (progress != g_client_state.recv_progress) {
+        g_client_state.recv_progress = progress;
+        update_prompt();
+        rl_redisplay();
     }
+}
 
-    if (bind(fd, (struct sockaddr *)sock, sizeof(struct sockaddr_un)) < 0) {
-        perror("bind");
-        exit(EXIT_FAILURE);
+/* feeds a MSG_CHUNK frame into its sender's reassembly buffer. returns 1 once the whole message is in history */
+int process_chunk(struct msg *msg)
+{
+    struct reassembly *slot;
+    uint32_t i;
+
+    if (msg->chunk_offset == 0) {
+        /* start of a new message; a sender only streams one at a time */
+        release_reassembly(msg->user_id);
+        if (msg->chunk_total > MAX_PASTE_SIZE || g_reassembly_bytes + msg->chunk_total > REASSEMBLY_BUDGET) {
+            return 0;
+        }
+        slot = find_reassembly(0);
+        if (slot == NULL) {
+            i = g_reassembly_cap;
+            g_reassembly = grow_user_slots(g_reassembly, &g_reassembly_cap, sizeof(struct reassembly));
+            slot = &g_reassembly[i];
+        }
+        slot->buf = malloc(msg->chunk_total + 1);
+        if (slot->buf == NULL) {
+            return 0;
+        }
+        slot->user_id = msg->user_id;
+        slot->chunk_id = msg->chunk_id;
+        slot->total = msg->chunk_total;
+        slot->received = 0;
+        g_reassembly_bytes += slot->total;
+    } else {
+        slot = find_reassembly(msg->user_id);
+        if (slot == NULL || slot->chunk_id != msg->chunk_id) {
+            /* we missed the start of this one (joined mid-stream?) */
+            return 0;
+        }
     }
 
-    if (listen(fd, 10) < 0) {
-        perror("bind");
-        exit(EXIT_FAILURE);
+    if (msg->chunk_offset != slot->received || msg->len == 0 || msg->len > slot->total - slot->received) {
+        /* chunks arrive in order and each moves the stream along; anything else means it's broken */
+        release_reassembly(msg->user_id);
+        set_recv_progress(0, 0);
+        return 0;
     }
 
-    num_fds = 1;
-    fds[0].fd = fd;
-    fds[0].events = POLLIN;
+    memcpy(slot->buf + slot->received, msg->msg, msg->len);
+    slot->received += msg->len;
+    if (slot->received < slot->total) {
+        set_recv_progress(slot->received, slot->total);
+        return 0;
+    }
 
-    while (1) {
-        //printf("poll returned %d\n", poll(fds, num_fds, -1));
-        poll(fds, num_fds, -1);
-        /* check new connection fd */
-        if (fds[0].revents & POLLIN) {
-            client_fd = accept(fd, (struct sockaddr *)&client_sock, &client_sock_len);
-
-            /* non blocking socket */
-            flags = fcntl(client_fd, F_GETFL, 0);
-            fcntl(client_fd, F_SETFL, flags | O_NONBLOCK);
-
-            /* put client_fd into empty fds slot */
-            fds[num_fds].fd = client_fd;
-            fds[num_fds].events = POLLIN;
-            fds[num_fds].revents = 0;
-
-            /* put client_fd into empty nick slot + init nick */
-            memset(nicks[num_fds], 0, NICK_SIZE);
-
-            num_fds++;
-        }
-        if ((fds[0].revents & ~POLLIN) > 0) {
-            printf("server fd has an event other than POLLIN: %x\n", fds[0].revents);
-        }
-        int remove = 0;
-        /* figure out which fds have events */
-        for (int i = 1; i < num_fds; i++) {
-            remove = 0;
-            /* there is data available on this fd */
-            if (fds[i].revents & POLLIN) {
-                /* read this msg */
-                struct msg msg = {0};
-                /* read a message */
-                int total_read = read_msg(fds[i].fd, &msg);
-
-                if (total_read == sizeof(struct msg)) {
-                    switch(msg.type) {
-                    case MSG_JOIN:
-                        if (nicks[i][0] == '\0') { /* if we don't have a nick for this user yet */
-                            /* make sure the nick isn't taken already */
-                            for (int j = 1; j < num_fds; j++) {
-                                if (strcmp(nicks[j], msg.nick) == 0) {
-                                    /* nick taken; reject this join */
-                                    msg.type = MSG_JOIN_REJECTED;
-                                    write_msg(fds[i].fd, &msg);
-                                    total_read = 0;
-                                    break;
-                                }
-                            }
-                            /* did we survive the duplicate nick check? */
-                            if (msg.type == MSG_JOIN) {
-                                snprintf(nicks[i], NICK_SIZE, "%s", msg.nick);
-                                /* ensure null-terminated */
-                                snprintf(msg.msg, sizeof(msg.msg), "%s joined the chat!", nicks[i]);
-                            }
-                        } else {
-                            /* ignore rejoin */
-                            total_read = 0;
-                        }
-                        break;
-                    case MSG_CLEAR_HISTORY:
-                        if (nicks[i][0] != '\0') {
-                            snprintf(msg.msg, sizeof(msg.msg), "%s cleared history!", nicks[i]);
-                        } else {
-                            /* received clear history from someone who hasn't given a nick yet */
-                            total_read = 0;
-                        }
-                        break;
-                    case MSG_QUIT:
-                        if (nicks[i][0] != '\0') {
-                            snprintf(msg.msg, sizeof(msg.msg), "%s left the chat!", nicks[i]);
-                        } else {
-                            /* received quit from someone who hasn't given a nick yet */
-                            total_read = 0;
-                        }
-                        remove = 1;
-                        break;
-                    case MSG_REDACT:
-                    case MSG_NORMAL:
-                        break;
-                    default:
-                        printf("received unknown command: %d, ignoring\n", msg.type);
-                        /* make sure we don't write anything to other clients */
-                        total_read = 0;
-                        break;
-                    }
-
-                    strncpy(msg.nick, nicks[i], NICK_SIZE-1);
-                    msg.user_id = fds[i].fd;
-
-                    /* propogate this message to all other sockets */
-                    /* we want to write this message back to the socket it came from, too */
-                    if (total_read == sizeof(struct msg)) {
-                        for (int j = 1; j < num_fds; j++) {
-                            /* write ALL THE DATA */
-                            if (nicks[j][0] != '\0') {
-                                write_msg(fds[j].fd, &msg);
-                            }
-                        }
-                    }
-                }
-            }
+    /* done; hand the buffer over to a history node */
+    slot->buf[sanitize_text(slot->buf, slot->total, 1)] = '\0';
+    msg->type = MSG_NORMAL;
+    msg->msg[0] = '\0';
+    add_long_message(msg, slot->buf);
+    slot->buf = NULL;
+    release_reassembly(msg->user_id);
+    set_recv_progress(0, 0);
 
-            if (fds[i].revents & POLLHUP) {
-                remove = 1;
-            }
-            if (fds[i].revents & POLLERR || fds[i].revents & POLLNVAL) {
-                remove = 1;
-            }
-            if (remove) {
-                close(fds[i].fd);
+    return 1;
+}
 
-                /* consolidate lists */
-                fds[i].fd = fds[num_fds-1].fd;
-                fds[i].events = POLLIN;
+void remove_mark_message()
+{
+    delete_node(g_mark);
+}
 
-                memcpy(nicks[i], nicks[num_fds-1], NICK_SIZE);
+void * paste_thread(void *arg)
+{
+    static uint32_t next_chunk_id = 0;
+    struct paste *paste = (struct paste *)arg;
+    struct msg msg = {0};
+    size_t offset, len;
+    uint8_t progress;
 
-                memset(nicks[num_fds-1], 0, NICK_SIZE);
+    msg.type = MSG_CHUNK;
+    msg.time = time(NULL);
+    msg.chunk_id = ++next_chunk_id;
+    msg.chunk_total = paste->len;
 
-                num_fds--;
-            }
+    for (offset = 0; offset < paste->len && !g_client_state.should_exit; offset += len) {
+        len = paste->len - offset;
+        if (len > MSG_CHUNK_SIZE) {
+            len = MSG_CHUNK_SIZE;
+        }
+        msg.chunk_offset = offset;
+        msg.len = len;
+        memcpy(msg.msg, paste->text + offset, len);
+        msg.msg[len] = '\0';
+        send_msg(paste->fd, &msg);
+
+        progress = (uint64_t)(offset + len) * 100 / paste->len;
+        if (progress != g_client_state.send_progress && progress > 0 && progress < 100) {
+            pthread_mutex_lock(&msg_mutex);
+            g_client_state.send_progress = progress;
+            update_prompt();
+            rl_redisplay();
+            pthread_mutex_unlock(&msg_mutex);
         }
     }
 
+    pthread_mutex_lock(&msg_mutex);
+    g_client_state.send_progress = 0;
+    update_prompt();
+    rl_redisplay();
+    pthread_mutex_unlock(&msg_mutex);
+
+    free(paste->text);
+    free(paste);
     pthread_exit(EXIT_SUCCESS);
 }
 
-void remove_mark_message()
+/* sends a message longer than MSG_SIZE as a stream of MSG_CHUNK frames. caller must hold msg_mutex */
+void start_paste(int fd, const char *text, size_t len)
 {
-    struct node *iter;
+    struct paste *paste;
+    pthread_t pt_paste;
 
-    iter = root;
+    if (len > MAX_PASTE_SIZE) {
+        add_info_message("message too long (%zu bytes, max %d)", len, MAX_PASTE_SIZE);
+        return;
+    }
+    if (g_client_state.send_progress) {
+        add_info_message("still sending the previous long message, try again shortly");
+        return;
+    }
 
-    while (iter) {
-        if (iter->msg.type == MSG_MARK) {
-            delete_node(iter);
-            iter = NULL;
-        } else {
-            iter = iter->next;
-        }
+    paste = malloc(sizeof(struct paste));
+    if (paste == NULL || (paste->text = strdup(text)) == NULL) {
+        free(paste);
+        add_info_message("out of memory sending long message");
+        return;
+    }
+    paste->fd = fd;
+    paste->len = len;
+
+    g_client_state.send_progress = 1;
+    update_prompt();
+    if (pthread_create(&pt_paste, NULL, &paste_thread, paste) != 0) {
+        g_client_state.send_progress = 0;
+        update_prompt();
+        free(paste->text);
+        free(paste);
+        add_info_message("couldn't start sending long message");
+        return;
     }
+    pthread_detach(pt_paste);
 }
 
 void * user_input_thread(void *arg)
@@ -546,7 +2321,7 @@ void * user_input_thread(void *arg)
         free(rl_str);
         msg.type = MSG_JOIN;
         msg.time = time(NULL);
-        write_msg(fd, &msg);
+        send_msg(fd, &msg);
 
         while (g_client_state.join_state == JOIN_PENDING) {
             sleep(0.5f);
@@ -565,6 +2340,10 @@ void * user_input_thread(void *arg)
     }
 
     using_history();
+    g_typing.fd = fd;
+    rl_event_hook = typing_event_hook;
+    rl_bind_keyseq(KEYSEQ_PAGE_UP, page_up_key);
+    rl_bind_keyseq(KEYSEQ_PAGE_DOWN, page_down_key);
     pthread_mutex_lock(&msg_mutex);
     clear_display();
     update_display();
@@ -573,6 +2352,13 @@ void * user_input_thread(void *arg)
     /* main msg processing loop */
     while (!g_client_state.should_exit && (rl_str = readline(g_client_state.prompt)) != NULL) {
         memset(&msg, 0, sizeof(struct msg));
+        if (g_client_state.num_urgent) {
+            /* they're back; whatever alerted them is on screen now */
+            pthread_mutex_lock(&msg_mutex);
+            g_client_state.num_urgent = 0;
+            update_title();
+            pthread_mutex_unlock(&msg_mutex);
+        }
         switch (strlen(rl_str)) {
         /* user pressed enter with no text entered; do a full screen refresh */
         case 0:
@@ -598,7 +2384,7 @@ void * user_input_thread(void *arg)
                 pthread_mutex_unlock(&msg_mutex);
                 msg.type = MSG_CLEAR_HISTORY;
                 msg.time = time(NULL);
-                write_msg(fd, &msg);
+                send_msg(fd, &msg);
                 continue;
             case UI_CLEAR_CMD:
                 pthread_mutex_lock(&msg_mutex);
@@ -624,7 +2410,87 @@ void * user_input_thread(void *arg)
                 pthread_mutex_unlock(&msg_mutex);
                 msg.type = MSG_REDACT;
                 msg.time = time(NULL);
-                write_msg(fd, &msg);
+                send_msg(fd, &msg);
+                continue;
+            case UI_PAGE_UP_CMD:
+            case UI_PAGE_DOWN_CMD:
+            case UI_JUMP_TO_MARK_CMD:
+            case UI_GOTO_PAGE_CMD:
+                pthread_mutex_lock(&msg_mutex);
+                printf("%s", CLEAR_LINE);
+                if (rl_str[0] == UI_PAGE_UP_CMD) {
+                    scroll_view(-1);
+                } else if (rl_str[0] == UI_PAGE_DOWN_CMD) {
+                    scroll_view(1);
+                } else if (rl_str[0] == UI_JUMP_TO_MARK_CMD) {
+                    jump_to_mark();
+                } else {
+                    follow_view();
+                }
+                update_display();
+                update_prompt();
+                pthread_mutex_unlock(&msg_mutex);
+                free(rl_str);
+                continue;
+            case UI_SEARCH_CMD:
+                pthread_mutex_lock(&msg_mutex);
+                printf("%s", CLEAR_LINE);
+                close_search();
+                update_display();
+                pthread_mutex_unlock(&msg_mutex);
+                free(rl_str);
+                continue;
+            case UI_STATS_CMD:
+                pthread_mutex_lock(&msg_mutex);
+                printf("%s", CLEAR_LINE);
+                update_display();
+                pthread_mutex_unlock(&msg_mutex);
+                msg.type = MSG_STATS;
+                msg.time = time(NULL);
+                send_msg(fd, &msg);
+                free(rl_str);
+                continue;
+            case UI_CYCLE_URGENT_MODE_CMD:
+                pthread_mutex_lock(&msg_mutex);
+                printf("%s", CLEAR_LINE);
+                g_client_state.urgent_mode = (g_client_state.urgent_mode + 1) % URGENT_NUM_MODES;
+                add_info_message("alerting on %s", g_urgent_mode_names[g_client_state.urgent_mode]);
+                update_display();
+                pthread_mutex_unlock(&msg_mutex);
+                free(rl_str);
+                continue;
+            case UI_HIGHLIGHT_CMD:
+                pthread_mutex_lock(&msg_mutex);
+                printf("%s", CLEAR_LINE);
+                highlight_command("");
+                update_display();
+                pthread_mutex_unlock(&msg_mutex);
+                free(rl_str);
+                continue;
+            case UI_TRACE_TOGGLE_CMD:
+                pthread_mutex_lock(&msg_mutex);
+                printf("%s", CLEAR_LINE);
+                g_client_state.trace_mode = !g_client_state.trace_mode;
+                add_info_message("latency tracing %s", g_client_state.trace_mode ? "enabled" : "disabled");
+                update_display();
+                pthread_mutex_unlock(&msg_mutex);
+                free(rl_str);
+                continue;
+            case UI_LATENCY_CMD:
+                pthread_mutex_lock(&msg_mutex);
+                printf("%s", CLEAR_LINE);
+                show_latency();
+                update_display();
+                pthread_mutex_unlock(&msg_mutex);
+                free(rl_str);
+                continue;
+            case UI_TRACE_EXPORT_CMD:
+                pthread_mutex_lock(&msg_mutex);
+                printf("%s", CLEAR_LINE);
+                export_trace();
+                update_display();
+                pthread_mutex_unlock(&msg_mutex);
+                free(rl_str);
                 continue;
             case UI_MARK_CMD:
                 msg.type = MSG_MARK;
@@ -641,6 +2507,49 @@ void * user_input_thread(void *arg)
                 break;
             }
         default:
+            /* command with an argument */
+            if (rl_str[0] == UI_SEARCH_CMD && rl_str[1] == ' ') {
+                pthread_mutex_lock(&msg_mutex);
+                printf("%s", CLEAR_LINE);
+                search_history(&rl_str[2]);
+                update_display();
+                pthread_mutex_unlock(&msg_mutex);
+                add_history(rl_str);
+                free(rl_str);
+                continue;
+            }
+            if (rl_str[0] == UI_HIGHLIGHT_CMD && rl_str[1] == ' ') {
+                pthread_mutex_lock(&msg_mutex);
+                printf("%s", CLEAR_LINE);
+                highlight_command(&rl_str[2]);
+                update_display();
+                pthread_mutex_unlock(&msg_mutex);
+                add_history(rl_str);
+                free(rl_str);
+                continue;
+            }
+            if (rl_str[0] == UI_GOTO_PAGE_CMD && rl_str[1] == ' ') {
+                pthread_mutex_lock(&msg_mutex);
+                printf("%s", CLEAR_LINE);
+                goto_page(strtol(&rl_str[2], NULL, 10));
+                update_display();
+                update_prompt();
+                pthread_mutex_unlock(&msg_mutex);
+                free(rl_str);
+                continue;
+            }
+            if (rl_str[0] == UI_RENAME_CMD && rl_str[1] == ' ') {
+                msg.type = MSG_RENAME;
+                msg.time = time(NULL);
+                strncpy(msg.nick, &rl_str[2], NICK_SIZE-1);
+                send_msg(fd, &msg);
+                pthread_mutex_lock(&msg_mutex);
+                printf("%s", CLEAR_LINE);
+                update_display();
+                pthread_mutex_unlock(&msg_mutex);
+                free(rl_str);
+                continue;
+            }
             break;
 
         }
@@ -651,12 +2560,31 @@ void * user_input_thread(void *arg)
         if (!g_client_state.clear_mode) {
             remove_mark_message();
         }
+        /* talking brings you back to the conversation */
+        if (g_view.bottom) {
+            follow_view();
+            update_prompt();
+        }
+        if (strlen(rl_str) >= MSG_SIZE) {
+            /* too big for one frame; stream it in chunks */
+            start_paste(fd, rl_str, strlen(rl_str));
+            g_typing.sent = TYPING_END_CMD;
+            update_display();
+            pthread_mutex_unlock(&msg_mutex);
+            free(rl_str);
+            continue;
+        }
         update_display();
         pthread_mutex_unlock(&msg_mutex);
         strncpy(msg.msg, rl_str, MSG_SIZE-1);
         msg.time = time(NULL);
         msg.type = MSG_NORMAL;
-        write_msg(fd, &msg);
+        /* everyone treats a message as the end of typing; no need to say so */
+        g_typing.sent = TYPING_END_CMD;
+        if (g_client_state.trace_mode) {
+            msg.trace[TRACE_CLIENT_SEND] = now_ns();
+        }
+        send_msg(fd, &msg);
         add_history(rl_str);
         free(rl_str);
     }
@@ -665,7 +2593,7 @@ void * user_input_thread(void *arg)
     memset(&msg, 0, sizeof(struct msg));
     msg.time = time(NULL);
     msg.type = MSG_QUIT;
-    write_msg(fd, &msg);
+    send_msg(fd, &msg);
     rl_clear_history();
     g_client_state.should_exit = 1;
     pthread_cond_signal(&exit_wait_cond);
@@ -675,14 +2603,19 @@ void * user_input_thread(void *arg)
 void * server_processing_thread(void *arg)
 {
     int fd = *(int *)arg;
+    int result;
 
     struct msg msg = {0};
 
     while (!g_client_state.should_exit) {
-        if (read_msg(fd, &msg) != sizeof(struct msg)) {
+        if (read_msg(fd, &msg) == 0) {
             break;
         }
 
+        if (msg.trace[TRACE_CLIENT_SEND]) {
+            msg.trace[TRACE_CLIENT_RECV] = now_ns();
+        }
+
         if (g_client_state.join_state == JOIN_PENDING) {
             switch (msg.type) {
             case MSG_JOIN:
@@ -701,11 +2634,25 @@ void * server_processing_thread(void *arg)
         }
 
         pthread_mutex_lock(&msg_mutex);
-        process_message(&msg);
+        result = process_message(&msg);
+        if (!result) {
+            pthread_mutex_unlock(&msg_mutex);
+            continue;
+        }
         update_display();
-        if (g_client_state.urgent_mode != URGENT_NONE) {
+        if (g_view.bottom) {
+            /* pinned; say how much is waiting below */
+            update_prompt();
+            rl_redisplay();
+        }
+        if (msg.trace[TRACE_CLIENT_SEND]) {
+            msg.trace[TRACE_RENDER_DONE] = now_ns();
+            record_trace(&msg);
+        }
+        if (result & PROCESS_URGENT) {
             printf("%s", VISIBLE_BEEP);
-            fflush(stdout);
+            g_client_state.num_urgent++;
+            update_title();
         }
         pthread_mutex_unlock(&msg_mutex);
     }
@@ -751,7 +2698,7 @@ void client(const struct sockaddr_un *sock)
 
     /* init state */
     clear_display();
-    g_client_state.urgent_mode = URGENT_ALL;
+    g_client_state.urgent_mode = URGENT_HIGHLIGHT;
     g_client_state.num_pending_msg = 0;
 
     /* need to create threads for user input + server processing */
@@ -771,60 +2718,122 @@ void client(const struct sockaddr_un *sock)
     return;
 }
 
+static void usage(const char *progname)
+{
+    printf("usage: %s [-m msgs/sec] [-M msg burst] [-b bytes/sec] [-B byte burst] [-k rule]... [-S socket]\n",
+        progname);
+    printf("rate limits apply per client when starting a new session; 0 disables a limit\n");
+    printf("-k takes a highlight rule as for the '%c' command: word, +nick or !nick\n", UI_HIGHLIGHT_CMD);
+    printf("-S joins the server listening on that socket (see jchatd) instead of asking for a key\n");
+    exit(EXIT_FAILURE);
+}
+
 int main(int argc, char **argv)
 {
     int is_server = 0;
+    int stop_pipe[2];
     char comms_dir_template[] = COMMS_DIR_TEMPLATE;
     char sockpath[sizeof(COMMS_DIR_TEMPLATE) + sizeof(JCHAT_SOCK_FILENAME)] = {0};
 
     char *response = NULL;
-
-    struct sockaddr_un sock = {
-        .sun_family = AF_UNIX
+    char *server_path = NULL, *base;
+
+    struct server_config config = {
+        .sock = { .sun_family = AF_UNIX },
+        .rate_msgs = DEFAULT_RATE_MSGS,
+        .burst_msgs = DEFAULT_BURST_MSGS,
+        .rate_bytes = DEFAULT_RATE_BYTES,
+        .burst_bytes = DEFAULT_BURST_BYTES,
+        .max_users = MAX_USERS,
+        .stop_fd = -1,
+        .control_fd = -1,
+        .takeover_fd = -1
     };
+    struct sockaddr_un *sock = &config.sock;
+    int opt;
+
+    /* limits only matter when we end up running the server; highlight rules are ours alone */
+    while ((opt = getopt(argc, argv, "m:M:b:B:k:S:")) != -1) {
+        switch (opt) {
+        case 'm':
+            config.rate_msgs = strtoul(optarg, NULL, 10);
+            break;
+        case 'M':
+            config.burst_msgs = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            config.rate_bytes = strtoul(optarg, NULL, 10);
+            break;
+        case 'B':
+            config.burst_bytes = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            highlight_command(optarg);
+            break;
+        case 'S':
+            server_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
 
-    if (argc != 1) {
-        printf("usage: %s\n", argv[0]);
-        exit(EXIT_FAILURE);
+    if (optind != argc) {
+        usage(argv[0]);
     }
 
-    response = readline("<enter> for new session, key for existing: ");
-    if (response == NULL) {
-        printf("goodbye!\n");
-        return 0;
-    } else if (response[0] == '\0') {
-        is_server = 1;
-        if (NULL == mkdtemp(comms_dir_template)) {
-            perror("mkdtemp");
-            exit(EXIT_FAILURE);
-        }
-        snprintf(sockpath, sizeof(sockpath), "%s", comms_dir_template);
-        snprintf(g_client_state.key, KEY_SIZE, "%s", &comms_dir_template[11]);
+    sanitize_init();
+
+    if (server_path) {
+        /* someone else (jchatd, probably) runs the server; the prompt shows its socket's name */
+        snprintf(sock->sun_path, sizeof(sock->sun_path), "%s", server_path);
+        base = strrchr(server_path, '/');
+        snprintf(g_client_state.key, KEY_SIZE, "%s", base ? base + 1 : server_path);
+        update_prompt();
     } else {
-        if (strlen(response) != 6) {
-            printf("invalid key, goodbye!\n");
-            exit(EXIT_FAILURE);
+        response = readline("<enter> for new session, key for existing: ");
+        if (response == NULL) {
+            printf("goodbye!\n");
+            return 0;
+        } else if (response[0] == '\0') {
+            is_server = 1;
+            if (NULL == mkdtemp(comms_dir_template)) {
+                perror("mkdtemp");
+                exit(EXIT_FAILURE);
+            }
+            snprintf(sockpath, sizeof(sockpath), "%s", comms_dir_template);
+            snprintf(g_client_state.key, KEY_SIZE, "%s", &comms_dir_template[11]);
         } else {
-            snprintf(sockpath, sizeof(sockpath), "/tmp/comms.%s", response);
-            snprintf(g_client_state.key, KEY_SIZE, "%s", response);
+            if (strlen(response) != 6) {
+                printf("invalid key, goodbye!\n");
+                exit(EXIT_FAILURE);
+            } else {
+                snprintf(sockpath, sizeof(sockpath), "/tmp/comms.%s", response);
+                snprintf(g_client_state.key, KEY_SIZE, "%s", response);
+            }
         }
-    }
 
-    update_prompt();
+        update_prompt();
 
-    if (response) {
-        free(response);
-    }
+        if (response) {
+            free(response);
+        }
 
-    strcat(sockpath, JCHAT_SOCK_FILENAME);
+        strcat(sockpath, JCHAT_SOCK_FILENAME);
 
-    snprintf(sock.sun_path, sizeof(sock.sun_path), "%s", sockpath);
+        snprintf(sock->sun_path, sizeof(sock->sun_path), "%s", sockpath);
+    }
 
     if (is_server) {
-        pthread_create(&pt_server, NULL, &server_thread, &sock);
+        if (pipe(stop_pipe) < 0) {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+        config.stop_fd = stop_pipe[0];
+        pthread_create(&pt_server, NULL, &server_thread, &config);
     }
 
-    client(&sock);
+    client(sock);
 
     // reset terminal
     printf("%s", RESET_TERM);
@@ -836,6 +2845,8 @@ int main(int argc, char **argv)
     if (is_server) {
         printf("server is still running... [enter] to stop\n");
         readline(NULL);
+        close(stop_pipe[1]);
+        pthread_join(pt_server, NULL);
         unlink(sockpath);
         rmdir(comms_dir_template);
     }
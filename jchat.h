@@ -10,11 +10,39 @@
 #define MSG_SIZE 4096
 #define KEY_SIZE 7
 #define MAX_CONNECT_RETRIES 10
-#define PROMPT_SIZE 32
+#define PROMPT_SIZE 64
 #define NICK_SIZE 16
-#define MAX_USERS 32
+#define MAX_USERS 32 /* default room size (jchatd -u changes it); the client's per-user tables start this big */
 #define MAX_DISPLAY_MESSAGES 200
+#define LAYOUT_MARK_ROWS 64 /* entries taller than this note where every this-many-th row starts */
+#define MSG_CHUNK_SIZE (MSG_SIZE - 1) /* payload bytes per MSG_CHUNK frame */
+#define MAX_PASTE_SIZE (16 * 1024 * 1024) /* cap on a single chunked message */
+#define REASSEMBLY_BUDGET (64 * 1024 * 1024) /* cap on all chunked messages being received at once */
+#define OUTQ_BULK_HIGH_WATER (256 * 1024) /* stop reading chunks while a client has this much bulk queued */
+#define HANDOFF_MAGIC 0x6a636864 /* "jchd" */
+#define HANDOFF_VERSION 1
+#define HANDOFF_TIMEOUT_MS 5000 /* how long a server waits on a replacement before carrying on itself */
+#define CAPTURE_MAGIC 0x6a636170 /* "jcap" */
+#define CAPTURE_VERSION 1
+#define OUTQ_MAX_BYTES (64 * 1024 * 1024) /* drop a client that falls this far behind */
+#define DEFAULT_RATE_MSGS 20 /* per-client token buckets; 0 disables a limit */
+#define DEFAULT_BURST_MSGS 50
+#define DEFAULT_RATE_BYTES (4 * 1024 * 1024)
+#define DEFAULT_BURST_BYTES (512 * 1024)
+#define RATE_LIMIT_NOTICE_MS 5000 /* tell a throttled client at most this often */
+#define SEARCH_MAX_RESULTS 1000 /* newest matches kept for display */
+#define SEARCH_INDEX_MAX_TEXT (64 * 1024) /* longer messages are always scanned instead of indexed */
+#define SEARCH_REBUILD_MIN 1024 /* rebuild the index once this many (and more than half) indexed messages are gone */
+#define LATENCY_BUCKETS 40
+#define TRACE_RING_SIZE 4096
+#define HIGHLIGHT_MAX_SPANS 32 /* highlighted matches kept per message */
+#define HIGHLIGHT_MAX_KEYWORD 64 /* bytes in a highlight keyword; the matcher takes a state per byte */
+#define URGENT_TITLE_FORMAT "(%u!) "
+#define PROCESS_REDRAW 0x1 /* process_message(): the screen needs redrawing */
+#define PROCESS_URGENT 0x2 /* process_message(): and the user's attention */
+#define TRACE_FILE_FORMAT "jchat-trace.%d.csv"
 #define LINE_UP "\033[1F"
+#define CURSOR_TO_ROW_FORMAT "\033[%u;1H"
 #define CLEAR_LINE "\033[K"
 #define SAVE_CURSOR "\0337"
 #define RESTORE_CURSOR "\0338"
@@ -25,12 +53,15 @@
 #define RESET_TERM "\033c"
 #define CHANGE_TITLE_FORMAT "\033]2;%s\007"
 #define CHANGE_TITLE_IS_TYPING_FORMAT "\033]2;%s...\007"
+#define CHANGE_TITLE_PAUSED_FORMAT "\033]2;%s (paused)\007"
 
 #define COLOR_NONE "\033[0m"
 #define COLOR_RED "\033[31m"
 #define COLOR_GREEN "\033[32m"
 #define COLOR_YELLOW "\033[33m"
 #define COLOR_CYAN "\033[36m"
+#define HIGHLIGHT_ON "\033[7m"
+#define HIGHLIGHT_OFF "\033[27m"
 
 /* ui commands */
 #define UI_CHANGE_PROMPT_CMD 'p'
@@ -39,15 +70,34 @@
 #define UI_CLEAR_HISTORY_CMD 'C'
 #define UI_CYCLE_URGENT_MODE_CMD 'u'
 #define UI_HELP_CMD 'h'
+#define UI_LATENCY_CMD 'L'
+#define UI_TRACE_TOGGLE_CMD 'l'
+#define UI_TRACE_EXPORT_CMD 'x'
 #define UI_MARK_CMD 'm'
 #define UI_QUIT_CMD 'q'
 #define UI_REDACT_CMD '-'
+#define UI_SEARCH_CMD 's' /* "s [@nick] [>HH:MM] [<HH:MM] <text>" searches; "s" alone closes the results */
+#define UI_STATS_CMD 'S'
+#define UI_PAGE_UP_CMD '<' /* also bound to PgUp */
+#define UI_PAGE_DOWN_CMD '>' /* also bound to PgDn */
+#define UI_JUMP_TO_MARK_CMD 'j'
+#define UI_GOTO_PAGE_CMD 'g' /* "g <page>" seeks to that page (1 is the oldest); "g" alone follows new messages again */
+#define KEYSEQ_PAGE_UP "\033[5~"
+#define KEYSEQ_PAGE_DOWN "\033[6~"
+#define UI_RENAME_CMD 'n' /* takes an argument: "n <new nick>" */
+#define UI_HIGHLIGHT_CMD 'k' /* "k <word>" highlights it, "k +<nick>"/"k !<nick>" always/never alert on a nick,
+                              * "k -<rule>" removes one; "k" alone lists them */
 #define UI_RESET_CMD 'r'
 
-/* TODO how will we use these (if it all)? */
+/* MSG_TYPING payloads */
 #define TYPING_START_CMD '\\'
 #define TYPING_END_CMD '/'
 #define TYPING_STALLED_CMD '|'
+#define TYPING_INTERVAL_MS 1000 /* at most one presence update per user per interval, client and server */
+#define TYPING_STALL_MS 5000 /* text entered but no edits for this long */
+#define TYPING_REFRESH_MS 10000 /* a typing state that holds is sent again this often... */
+#define TYPING_TIMEOUT_MS 30000 /* ...and one not heard again for this long is dropped */
+#define TITLE_DEFAULT "jchat"
 
 enum msg_type {
     MSG_NORMAL,
@@ -56,7 +106,24 @@ enum msg_type {
     MSG_REDACT,
     MSG_CLEAR_HISTORY,
     MSG_MARK,
-    MSG_QUIT
+    MSG_QUIT,
+    MSG_RENAME,
+    MSG_RENAME_REJECTED,
+    MSG_CHUNK, /* one piece of a message longer than MSG_SIZE */
+    MSG_TYPING, /* presence; msg[0] is one of the TYPING_*_CMDs */
+    MSG_RATE_LIMITED, /* server -> one client: you're being throttled */
+    MSG_STATS, /* client -> server: request; server -> that client: one line of stats */
+    MSG_INFO /* local only; never sent on the wire */
+};
+
+/* hops a traced message is stamped at (CLOCK_MONOTONIC nanoseconds) */
+enum trace_hop {
+    TRACE_CLIENT_SEND = 0,
+    TRACE_SERVER_RECV,
+    TRACE_SERVER_FANOUT, /* stamped once, as the frame is queued for its recipients */
+    TRACE_CLIENT_RECV,
+    TRACE_RENDER_DONE,
+    TRACE_NUM_HOPS
 };
 
 enum join_state {
@@ -65,10 +132,13 @@ enum join_state {
     JOINED
 };
 
+/* what beeps and marks the title; UI_CYCLE_URGENT_MODE_CMD goes through these in order */
 enum urgent_type {
     URGENT_ALL = 0,
-    URGENT_MSG_ONLY = 1,
-    URGENT_NONE = 2
+    URGENT_MSG_ONLY, /* messages from other users */
+    URGENT_HIGHLIGHT, /* messages that match a highlight rule, or are from an allowed nick */
+    URGENT_NONE,
+    URGENT_NUM_MODES
 };
 
 struct client_state {
@@ -79,46 +149,437 @@ struct client_state {
     uint8_t clear_mode; /* is clear mode enabled? */
     uint8_t transient_mode; /* is transient mode enabled? */
     uint8_t urgent_mode; /* urgent mode */
+    uint32_t num_urgent; /* alerts since the user last entered anything; shown in the title */
+    char nick[NICK_SIZE]; /* ours, as the server has it; highlighted like a keyword */
+    uint8_t trace_mode; /* is latency tracing enabled? */
+    uint8_t send_progress; /* percent of an outgoing chunked message sent; 0 if none */
+    uint8_t recv_progress; /* percent of the latest incoming chunked message received; 0 if none */
     uint32_t num_pending_msg;
     uint8_t should_exit;
 };
 
-/* this is what gets passed on the wire */
+/* this is what gets passed on the wire. only the first `len` bytes of msg are sent */
 __attribute__((packed)) struct msg {
     enum msg_type type;
     time_t time;
     int user_id;
     char nick[NICK_SIZE];
+    uint64_t trace[TRACE_NUM_HOPS]; /* all zero unless the sender enabled tracing */
+    uint32_t chunk_id; /* MSG_CHUNK: per-sender id of the message being streamed */
+    uint32_t chunk_offset; /* MSG_CHUNK: where this payload goes in the full message */
+    uint32_t chunk_total; /* MSG_CHUNK: length of the full message */
+    uint16_t len; /* payload length; filled in by frame_msg() */
     char msg[MSG_SIZE];
 };
 
+#define MSG_HEADER_SIZE offsetof(struct msg, msg)
+
+/* server-side refcounted wire frame, shared by every recipient's queue */
+struct frame {
+    uint32_t refs;
+    uint32_t len;
+    char data[];
+};
+
+struct outq_node {
+    struct frame *frame;
+    struct outq_node *next;
+};
+
+enum outq_type {
+    OUTQ_NORMAL = 0, /* always drained first */
+    OUTQ_BULK, /* MSG_CHUNK traffic */
+    OUTQ_NUM
+};
+
+struct outq {
+    struct outq_node *head;
+    struct outq_node *tail;
+    size_t bytes;
+};
+
+struct token_bucket {
+    double tokens;
+    double rate; /* tokens per second; 0 means unlimited */
+    double burst;
+    uint64_t last_ns;
+};
+
+/* server-side connection record */
+struct conn {
+    int fd;
+    int user_id; /* stable for the life of the connection; never reused */
+    char nick[NICK_SIZE]; /* trimmed nick as displayed; empty until joined */
+    char nick_key[NICK_SIZE]; /* normalized (trimmed, case-folded) registry key */
+    struct conn *nick_next; /* nick registry hash chain */
+    struct msg in; /* frame being received */
+    size_t in_len; /* bytes of `in` received so far */
+    uint32_t chunk_id; /* chunked message this client is streaming */
+    uint32_t chunk_left; /* bytes of it still to come; 0 if none */
+    char typing_pending; /* latest typing state not yet broadcast; 0 if none */
+    uint64_t typing_sent_ns; /* when we last broadcast this client's typing state */
+    struct token_bucket msg_bucket;
+    struct token_bucket byte_bucket;
+    uint8_t held; /* `in` is complete but over the limit; reads are paused until held_until */
+    uint8_t hung_up; /* peer is gone; drain what it sent without limits */
+    uint8_t left; /* sent MSG_QUIT (or the server's going down), so there's no departure to announce */
+    uint64_t held_since;
+    uint64_t held_until;
+    uint64_t limit_notice_ns;
+    struct outq out[OUTQ_NUM];
+    struct outq_node *sending; /* frame partially written to fd */
+    size_t sending_off;
+};
+
+/* server-side nick -> connection hash table (separate chaining) */
+struct nick_registry {
+    struct conn **buckets;
+    uint32_t mask;
+};
+
+/* server options */
+struct server_config {
+    struct sockaddr_un sock;
+    uint32_t rate_msgs;
+    uint32_t burst_msgs;
+    uint32_t rate_bytes;
+    uint32_t burst_bytes;
+    uint32_t max_users;
+    int stop_fd; /* server_thread() shuts down and returns once this is readable; -1 to run forever */
+    int control_fd; /* listening socket a replacement server connects to for a hot restart; -1 for none */
+    int takeover_fd; /* connected to the control socket of the server we're replacing; -1 to start fresh */
+    uint8_t handed_off; /* set when server_thread() returned because a replacement took over */
+    FILE *capture; /* every connect, inbound frame and hangup is recorded here for jreplay; NULL for none */
+};
+
+struct server_stats {
+    uint64_t start_ns;
+    uint64_t msgs_in;
+    uint64_t bytes_in;
+    uint64_t msgs_out; /* frames queued, counted per recipient */
+    uint64_t bytes_out;
+    uint64_t rate_limited; /* times a client was throttled */
+    uint64_t deferred_ns; /* total time frames were held by the limiter */
+    uint64_t dropped; /* clients dropped for falling OUTQ_MAX_BYTES behind */
+};
+
+/* traffic capture: a capture_header, then a capture_record per event. frame records are followed by
+ * the len bytes of the frame exactly as it arrived */
+struct capture_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t start_ns;
+};
+
+enum capture_event {
+    CAPTURE_CONNECT = 0,
+    CAPTURE_FRAME,
+    CAPTURE_DISCONNECT
+};
+
+struct capture_record {
+    uint64_t ns; /* since start_ns */
+    uint32_t user_id; /* the connection it happened on */
+    uint16_t event;
+    uint16_t len;
+};
+
+/* hot restart: what a running server hands the one replacing it over the control socket. the header
+ * carries the listening and control sockets, each conn record its client's socket (SCM_RIGHTS) */
+struct handoff_header {
+    uint32_t magic;
+    uint32_t version; /* both sides must be built from the same structs */
+    uint32_t num_conns;
+    int next_user_id;
+    struct sockaddr_un sock;
+    struct server_stats stats;
+};
+
+/* followed by in_len bytes of the frame being read (all of it if held), the sending_len bytes of the
+ * frame being written, then for each queue, num_frames times a uint32_t length and that many bytes */
+struct handoff_conn {
+    int user_id;
+    char nick[NICK_SIZE];
+    uint32_t in_len;
+    uint32_t chunk_id;
+    uint32_t chunk_left;
+    char typing_pending;
+    uint64_t typing_sent_ns;
+    struct token_bucket msg_bucket;
+    struct token_bucket byte_bucket;
+    uint8_t held;
+    uint8_t hung_up;
+    uint64_t held_since;
+    uint64_t held_until;
+    uint64_t limit_notice_ns;
+    uint32_t sending_len;
+    uint32_t num_frames[OUTQ_NUM];
+};
+
+/* the fixed entries at the front of server.fds; clients come after */
+enum server_fd {
+    SERVER_FD_LISTEN = 0,
+    SERVER_FD_STOP,
+    SERVER_FD_CONTROL,
+    SERVER_FD_FIRST_CONN
+};
+
+/* server state; from SERVER_FD_FIRST_CONN on, fds[i] and conns[i] describe the same client */
+struct server {
+    struct pollfd *fds; /* SERVER_FD_FIRST_CONN + config->max_users of them */
+    struct conn **conns; /* parallel to fds */
+    int num_fds;
+    int next_user_id;
+    struct nick_registry nick_registry;
+    struct server_config *config;
+    struct server_stats stats;
+};
+
+/* client-side buffer for a chunked message being received */
+struct reassembly {
+    int user_id; /* 0 if this slot is free */
+    uint32_t chunk_id;
+    uint32_t total;
+    uint32_t received;
+    char *buf;
+};
+
+/* client-side typing state of one other user */
+struct typing_user {
+    int user_id; /* 0 if this slot is free */
+    char nick[NICK_SIZE];
+    char state; /* TYPING_START_CMD or TYPING_STALLED_CMD */
+    uint64_t seen_ns; /* when we last heard it */
+};
+
+/* client-side state of our own typing, sampled from readline */
+struct typing_state {
+    int fd;
+    int edit_end; /* rl_end/rl_point as last seen, to spot edits */
+    int edit_point;
+    uint64_t last_edit_ns;
+    char sent; /* state the others last heard from us */
+    uint64_t sent_ns;
+    uint64_t expired_ns; /* when the others' typing states were last checked for timeouts */
+};
+
+/* an outgoing chunked message, sent from its own thread */
+struct paste {
+    int fd;
+    char *text;
+    size_t len;
+};
+
+/* one completed trace, kept in a ring for export */
+struct trace_record {
+    int user_id;
+    char nick[NICK_SIZE];
+    uint64_t trace[TRACE_NUM_HOPS];
+};
+
+/* end-to-end (send -> render) latency histogram; bucket i counts samples in [2^i, 2^(i+1)) ns */
+struct latency_stats {
+    uint64_t count;
+    uint64_t hop_total[TRACE_NUM_HOPS]; /* sum of (hop[i] - hop[i-1]); index 0 unused */
+    uint64_t buckets[LATENCY_BUCKETS];
+    struct trace_record ring[TRACE_RING_SIZE];
+    uint32_t ring_next;
+};
+
+/* a highlighted stretch of a message's text */
+struct span {
+    uint32_t start;
+    uint32_t end;
+};
+
 /* this is what gets stored in the client(s) */
 struct node {
     struct msg msg; /* note: this is *NOT* packed */
+    char *text; /* reassembled text of a chunked message, else NULL (use msg.msg) */
+    struct span *spans; /* highlight rule matches in the text, sorted and not overlapping; NULL if none */
+    uint16_t num_spans;
+    uint32_t id; /* assigned in add_new_message; never reused */
+    uint16_t layout_cols; /* terminal width layout_rows was computed for; 0 if never laid out */
+    uint16_t layout_prefix; /* display width of the timestamp/nick prefix at that time */
+    uint32_t layout_rows; /* screen rows the whole entry takes, wrapping included */
+    uint32_t layout_len; /* length of the text it was laid out from */
+    uint32_t *layout_marks; /* layout_marks[i] is where row (i + 1) * LAYOUT_MARK_ROWS + 1 starts */
+    uint32_t layout_num_marks;
     struct node *next;
     struct node *prev;
 };
 
+/* Aho-Corasick automaton over the highlight patterns, with the failure links folded into the transitions
+ * so matching is one lookup per byte however many patterns there are. patterns are ASCII case-insensitive */
+struct ac_state {
+    int32_t next[256];
+    int32_t fail;
+    int32_t pattern; /* longest pattern ending here, or -1 */
+    int32_t out_link; /* nearest state down the failure chain that ends a pattern, or -1 */
+};
+
+struct matcher {
+    struct ac_state *states;
+    uint32_t num_states;
+    uint32_t cap;
+    uint32_t *pattern_len;
+    char *pattern_edges; /* per pattern: whether its first/last byte is alphanumeric (bits 0/1) */
+    uint32_t num_patterns;
+};
+
+/* sorted, case-insensitive set of strings */
+struct rule_list {
+    char **items;
+    uint32_t count;
+    uint32_t cap;
+};
+
+struct highlight_rules {
+    struct rule_list keywords;
+    struct rule_list allow; /* nicks whose messages always alert */
+    struct rule_list deny; /* nicks whose messages never alert or highlight */
+    struct matcher matcher; /* keywords plus our own nick */
+};
+
+/* where a layout walk has got to: rows used so far, and columns filled on the last one */
+struct layout {
+    uint32_t rows;
+    uint32_t col; /* == cols means the row is full and the next glyph wraps */
+};
+
+/* which part of history is on screen */
+struct view {
+    struct node *bottom; /* last node shown; NULL to follow new messages */
+    uint32_t new_below; /* messages that arrived below a pinned view */
+};
+
+/* client-side id -> node map over the whole history */
+struct history_index {
+    struct node **slots; /* node with id lives at slots[start + (id - first_id)]; NULL once deleted */
+    size_t start;
+    size_t cap;
+    uint32_t first_id;
+    uint32_t next_id;
+};
+
+/* Fenwick tree of the screen rows each entry takes, by id, so goto_page() can find the entry holding
+ * any row of the history without walking to it. built on first use, and again when the width or the
+ * day (which changes how old timestamps print) isn't what it was built for */
+struct row_index {
+    uint64_t *tree; /* tree[1..size]; the entry with id base + i - 1 is at i */
+    uint32_t size; /* a power of 2 */
+    uint32_t base;
+    uint32_t cols; /* width it was built for; 0 if it needs building */
+    int day;
+};
+
+/* trigram -> ids of the MSG_NORMAL messages containing it, ascending */
+struct posting {
+    uint32_t key; /* 3 case-folded bytes + 1; 0 if this slot is empty */
+    uint32_t len;
+    uint32_t cap;
+    uint32_t *ids;
+};
+
+/* open-addressed trigram table, maintained as messages are added and deleted */
+struct search_index {
+    struct posting *table;
+    uint32_t mask;
+    uint32_t used;
+    uint32_t live; /* indexed messages still in history */
+    uint32_t dead; /* indexed messages deleted since the last rebuild; their ids linger in postings */
+    uint32_t *unindexed; /* ids of messages too long to index; always scanned */
+    uint32_t unindexed_len;
+    uint32_t unindexed_cap;
+};
+
+struct search_query {
+    char text[MSG_SIZE]; /* case-folded */
+    size_t len;
+    char nick[NICK_SIZE];
+    time_t after; /* 0 if unbounded */
+    time_t before;
+};
+
+/* what the search view is showing */
+struct search_results {
+    uint8_t active;
+    char query[BUF_SIZE];
+    uint32_t *ids; /* ascending */
+    uint32_t count;
+    uint32_t total; /* matches, including any beyond SEARCH_MAX_RESULTS */
+    uint64_t elapsed_ns;
+};
+
 /* FUNCTION DECLARATIONS */
 
+int codepoint_width(uint32_t cp);
+size_t utf8_width(const char *s, size_t len);
+size_t layout_walk(struct layout *lay, const char *s, size_t len, uint32_t cols, uint32_t stop_row);
+uint32_t node_rows(struct node *node, uint32_t cols);
 void update_display(void);
 void clear_display(void);
-void add_new_message(struct msg *);
+struct node *add_new_message(struct msg *);
+struct node *add_long_message(struct msg *msg, char *text);
 void ignore_signal(int signum);
 void update_prompt(void);
-void write_msg(int fd, struct msg *msg);
+size_t frame_msg(struct msg *msg);
+int write_msg(int fd, struct msg *msg);
+void send_msg(int fd, struct msg *msg);
 int read_msg(int fd, struct msg *msg);
+size_t read_full(int fd, void *buf, size_t len);
+int write_full(int fd, const void *buf, size_t len);
 void clear_history(void);
+struct node *history_lookup(uint32_t id);
+void search_index_add(struct node *node);
+void search_index_forget(struct node *node);
+void search_index_rebuild(void);
+const char *find_ci(const char *hay, size_t hay_len, const char *needle, size_t needle_len);
+void search_history(const char *args);
+void close_search(void);
+void scroll_view(int pages);
+void jump_to_mark(void);
+void goto_page(long page);
+void follow_view(void);
+int page_up_key(int count, int key);
+int page_down_key(int count, int key);
 void delete_node(struct node *node);
 void copy_msg(struct node *dst, struct msg *src);
 int redact_message(int user_id);
 void window_resized(int signum);
-void process_message(struct msg *msg);
+void matcher_build(struct matcher *m, const char **patterns, uint32_t num_patterns);
+void matcher_free(struct matcher *m);
+uint32_t matcher_find(const struct matcher *m, const char *text, size_t len, struct span *spans, uint32_t max_spans);
+void highlight_rebuild(void);
+int highlight_node(struct node *node);
+void highlight_command(const char *args);
+int process_message(struct msg *msg);
+int process_chunk(struct msg *msg);
+void release_reassembly(int user_id);
+void start_paste(int fd, const char *text, size_t len);
+int typing_event_hook(void);
+void set_typing(int user_id, const char *nick, char state);
+void update_title(void);
 void client(const struct sockaddr_un *sock);
+void nick_registry_init(struct nick_registry *reg, uint32_t capacity);
+struct conn *nick_lookup(struct nick_registry *reg, const char *key);
+void nick_insert(struct nick_registry *reg, struct conn *conn);
+void nick_remove(struct nick_registry *reg, struct conn *conn);
+int nick_claim(struct nick_registry *reg, struct conn *conn, const char *nick);
+uint64_t now_ns(void);
+void add_info_message(const char *fmt, ...);
+void record_trace(struct msg *msg);
+void show_latency(void);
+void export_trace(void);
 
-/* Responsible for the message multiplexing to clients. Only runs for the server (first user to connect) */
+/* Responsible for the message multiplexing to clients. Runs on a thread in the first user to connect, or
+ * as all of jchatd. Returns once config->stop_fd is readable.
+ * arg is a struct server_config */
 void *server_thread(void *arg);
 
+/* Streams one chunked message to the server so input stays responsive. Runs for all users */
+void *paste_thread(void *arg);
+
 /* Responsible for handling user input. Runs for all users */
 void *user_input_thread(void *arg);
 
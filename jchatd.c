@@ -0,0 +1,245 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "jchat.h"
+#include "sanitize.h"
+
+/* jchatd: the server on its own. a session started here doesn't end when whoever started it leaves, and
+ * nothing the server does waits behind a terminal */
+
+static int g_stop_pipe[2];
+
+static void request_stop(int signum)
+{
+    int saved_errno = errno;
+
+    /* the server sees the pipe become readable and shuts down between rounds */
+    if (write(g_stop_pipe[1], "", 1) < 0) {
+        /* already full of stop requests */
+    }
+    errno = saved_errno;
+}
+
+static void usage(const char *progname)
+{
+    printf("usage: %s [-S socket] [-u max users] [-m msgs/sec] [-M msg burst] [-b bytes/sec] [-B byte burst]\n"
+        "       [-c cpu] [-r priority] [-C control socket [-T]] [-w capture file]\n", progname);
+    printf("without -S, starts a new session and prints its key for jchat to join\n");
+    printf("-C listens for a replacement server; -T is that replacement, taking over the session and its\n"
+        "clients from the server on the control socket without anyone reconnecting\n");
+    printf("-w records all client traffic to a new file (never an existing one) that jreplay can play back\n");
+    printf("-c pins the server to a cpu; -r runs it SCHED_FIFO at that priority\n");
+    printf("rate limits apply per client; 0 disables a limit. SIGINT or SIGTERM shuts down\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    char comms_dir_template[] = COMMS_DIR_TEMPLATE;
+    char *server_path = NULL, *control_path = NULL, *capture_path = NULL, *slash;
+    struct sockaddr_un control_sock = { .sun_family = AF_UNIX };
+    struct server_config config = {
+        .sock = { .sun_family = AF_UNIX },
+        .rate_msgs = DEFAULT_RATE_MSGS,
+        .burst_msgs = DEFAULT_BURST_MSGS,
+        .rate_bytes = DEFAULT_RATE_BYTES,
+        .burst_bytes = DEFAULT_BURST_BYTES,
+        .max_users = MAX_USERS,
+        .stop_fd = -1,
+        .control_fd = -1,
+        .takeover_fd = -1
+    };
+    FILE *capture = NULL;
+    struct sigaction action;
+    struct sched_param param;
+    cpu_set_t cpus;
+    int fd, opt, cpu = -1, priority = 0, takeover = 0;
+
+    while ((opt = getopt(argc, argv, "S:u:m:M:b:B:c:r:C:Tw:")) != -1) {
+        switch (opt) {
+        case 'S':
+            server_path = optarg;
+            break;
+        case 'u':
+            config.max_users = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            config.rate_msgs = strtoul(optarg, NULL, 10);
+            break;
+        case 'M':
+            config.burst_msgs = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            config.rate_bytes = strtoul(optarg, NULL, 10);
+            break;
+        case 'B':
+            config.burst_bytes = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            cpu = atoi(optarg);
+            break;
+        case 'r':
+            priority = atoi(optarg);
+            break;
+        case 'C':
+            control_path = optarg;
+            break;
+        case 'T':
+            takeover = 1;
+            break;
+        case 'w':
+            capture_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    /* a replacement gets the session's socket from the server it replaces */
+    if (optind != argc || config.max_users < 1 || (takeover && (control_path == NULL || server_path))) {
+        usage(argv[0]);
+    }
+
+    if (control_path) {
+        if (strlen(control_path) >= sizeof(control_sock.sun_path)) {
+            fprintf(stderr, "control socket path too long\n");
+            exit(EXIT_FAILURE);
+        }
+        snprintf(control_sock.sun_path, sizeof(control_sock.sun_path), "%s", control_path);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            perror("socket");
+            exit(EXIT_FAILURE);
+        }
+        if (takeover) {
+            if (connect(fd, (struct sockaddr *)&control_sock, sizeof(control_sock)) < 0) {
+                perror("connect");
+                exit(EXIT_FAILURE);
+            }
+            config.takeover_fd = fd;
+        } else {
+            if (bind(fd, (struct sockaddr *)&control_sock, sizeof(control_sock)) < 0) {
+                perror("bind");
+                exit(EXIT_FAILURE);
+            }
+            if (listen(fd, 1) < 0) {
+                perror("listen");
+                exit(EXIT_FAILURE);
+            }
+            config.control_fd = fd;
+        }
+    }
+
+    if (capture_path) {
+        /* x: two servers given the same path would otherwise truncate each other's capture */
+        capture = fopen(capture_path, "wbx");
+        if (capture == NULL) {
+            perror(capture_path);
+            exit(EXIT_FAILURE);
+        }
+        config.capture = capture;
+    }
+
+    if (takeover) {
+        /* filled in by the handoff */
+    } else if (server_path) {
+        if (strlen(server_path) >= sizeof(config.sock.sun_path)) {
+            fprintf(stderr, "socket path too long\n");
+            exit(EXIT_FAILURE);
+        }
+        snprintf(config.sock.sun_path, sizeof(config.sock.sun_path), "%s", server_path);
+    } else {
+        if (NULL == mkdtemp(comms_dir_template)) {
+            perror("mkdtemp");
+            exit(EXIT_FAILURE);
+        }
+        snprintf(config.sock.sun_path, sizeof(config.sock.sun_path), JCHAT_SOCK_FORMAT, comms_dir_template);
+        printf("key: %s\n", &comms_dir_template[11]);
+    }
+
+    if (cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+            perror("sched_setaffinity");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (priority > 0) {
+        param.sched_priority = priority;
+        if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+            perror("sched_setscheduler");
+            exit(EXIT_FAILURE);
+        }
+        /* a page fault in the middle of a round would cost more than the priority buys */
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+            perror("mlockall");
+        }
+    }
+
+    if (pipe(g_stop_pipe) < 0) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    config.stop_fd = g_stop_pipe[0];
+
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0;
+    action.sa_handler = request_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    /* the session outlives the terminal it was started from */
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGHUP, &action, NULL);
+    sigaction(SIGPIPE, &action, NULL);
+
+    sanitize_init();
+
+    if (takeover) {
+        printf("taking over from %s\n", control_path);
+    } else {
+        printf("listening on %s\n", config.sock.sun_path);
+    }
+    fflush(stdout);
+
+    server_thread(&config);
+
+    if (capture) {
+        fclose(capture);
+    }
+    if (config.handed_off) {
+        /* the sockets and the session are the replacement's now */
+        printf("handed off\n");
+        return 0;
+    }
+
+    unlink(config.sock.sun_path);
+    if (control_path) {
+        unlink(control_path);
+    }
+    /* whichever server ends a session it made (or took over) removes its comms dir */
+    slash = strrchr(config.sock.sun_path, '/');
+    if (server_path == NULL && slash &&
+            strncmp(config.sock.sun_path, COMMS_DIR_TEMPLATE, strlen(COMMS_DIR_TEMPLATE) - 6) == 0) {
+        *slash = '\0';
+        rmdir(config.sock.sun_path);
+    }
+    printf("shut down\n");
+
+    return 0;
+}
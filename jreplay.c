@@ -0,0 +1,492 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "jchat.h"
+
+/* jreplay: plays a capture recorded by jchatd -w back into a server through the real protocol, and
+ * reports how fast it went through and how long fanout took. save one build's results with -o and
+ * compare another against them with -b. run the server without limits (jchatd -m 0 -b 0) or the limits
+ * are what gets measured. every frame goes out traced, so a jchat in the room with tracing on ('l')
+ * measures the render path against the same traffic */
+
+#define REPLAY_DRAIN_MS 1000 /* once the capture is done, stop waiting after this long without a frame */
+#define LEFT 0 /* user ids start at 1 */
+
+enum result {
+    RESULT_FRAMES_SENT = 0,
+    RESULT_FRAMES_RECEIVED,
+    RESULT_FRAMES_SKIPPED, /* captured from a connection the capture never saw connect */
+    RESULT_SEND_SECS,
+    RESULT_SENT_PER_SEC,
+    RESULT_RECEIVED_PER_SEC,
+    RESULT_LATENCY_MEAN,
+    RESULT_LATENCY_P50,
+    RESULT_LATENCY_P99,
+    RESULT_LATENCY_MAX,
+    RESULT_SEND_SERVER, /* mean of each traced hop up to the recipient */
+    RESULT_SERVER_FANOUT,
+    RESULT_FANOUT_RECV,
+    RESULT_NUM
+};
+
+static const char *result_names[RESULT_NUM] = {
+    "frames_sent", "frames_received", "frames_skipped", "send_secs", "sent_per_sec", "received_per_sec",
+    "latency_mean_us", "latency_p50_us", "latency_p99_us", "latency_max_us",
+    "send->server_us", "server->fanout_us", "fanout->recv_us"
+};
+
+/* a replayed connection. both ways are nonblocking: a frame for the server waits in out until the socket
+ * takes it, and in collects what the server sends a piece at a time, so a big paste going up can't
+ * wedge us against fanout we aren't reading coming down */
+struct replay_conn {
+    uint32_t user_id; /* the captured connection this stands in for, or LEFT once that hung up */
+    struct msg in; /* frame being received */
+    size_t in_len;
+    char *out; /* out[out_off..out_len) still to be written */
+    size_t out_off;
+    size_t out_len;
+    size_t out_cap;
+};
+
+/* replayed connections; fds[i] belongs to conns[i] */
+static struct pollfd *g_fds;
+static struct replay_conn *g_conns;
+static int g_num_fds, g_max_fds;
+static size_t g_queued; /* bytes waiting in every out */
+
+/* end-to-end latency of every traced frame received, and the sum of each hop */
+static uint64_t *g_samples;
+static size_t g_num_samples, g_max_samples;
+static uint64_t g_hop_total[TRACE_NUM_HOPS];
+static uint64_t g_received, g_last_recv_ns;
+
+static void usage(const char *progname)
+{
+    printf("usage: %s [-f] [-x speed] [-o results] [-b baseline results] <capture> <socket>\n", progname);
+    printf("replays a jchatd -w capture into the server listening on <socket>, at the captured pace\n");
+    printf("times speed (default 1), or as fast as it goes with -f\n");
+    printf("-o saves the results; -b shows how they differ from ones saved earlier\n");
+    exit(EXIT_FAILURE);
+}
+
+static int find_conn(uint32_t user_id)
+{
+    for (int i = 0; i < g_num_fds; i++) {
+        if (g_conns[i].user_id == user_id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void remove_conn(int i)
+{
+    close(g_fds[i].fd);
+    g_queued -= g_conns[i].out_len - g_conns[i].out_off;
+    free(g_conns[i].out);
+    g_num_fds--;
+    g_fds[i] = g_fds[g_num_fds];
+    g_conns[i] = g_conns[g_num_fds];
+}
+
+static void add_conn(const char *path, uint32_t user_id)
+{
+    struct sockaddr_un sock = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (g_num_fds == g_max_fds) {
+        g_max_fds = g_max_fds ? g_max_fds * 2 : MAX_USERS;
+        g_fds = realloc(g_fds, g_max_fds * sizeof(struct pollfd));
+        g_conns = realloc(g_conns, g_max_fds * sizeof(struct replay_conn));
+        if (g_fds == NULL || g_conns == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    snprintf(sock.sun_path, sizeof(sock.sun_path), "%s", path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+    if (connect(fd, (struct sockaddr *)&sock, sizeof(sock)) < 0) {
+        perror("connect");
+        exit(EXIT_FAILURE);
+    }
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        exit(EXIT_FAILURE);
+    }
+
+    g_fds[g_num_fds].fd = fd;
+    g_fds[g_num_fds].events = POLLIN;
+    g_fds[g_num_fds].revents = 0;
+    memset(&g_conns[g_num_fds], 0, sizeof(struct replay_conn));
+    g_conns[g_num_fds].user_id = user_id;
+    g_num_fds++;
+}
+
+/* writes what the socket will take of conns[i]'s out. returns -1 if the server's gone */
+static int conn_write(int i)
+{
+    struct replay_conn *conn = &g_conns[i];
+    ssize_t bytes_written;
+
+    while (conn->out_off < conn->out_len) {
+        bytes_written = send(g_fds[i].fd, conn->out + conn->out_off, conn->out_len - conn->out_off,
+            MSG_NOSIGNAL);
+        if (bytes_written > 0) {
+            conn->out_off += bytes_written;
+            g_queued -= bytes_written;
+        } else if (bytes_written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            g_fds[i].events |= POLLOUT;
+            return 0;
+        } else {
+            return -1;
+        }
+    }
+
+    conn->out_off = conn->out_len = 0;
+    g_fds[i].events &= ~POLLOUT;
+    return 0;
+}
+
+/* queues a frame for the server and writes what it can of it now */
+static int conn_send(int i, const char *buf, size_t len)
+{
+    struct replay_conn *conn = &g_conns[i];
+
+    if (conn->out_off > 0) {
+        memmove(conn->out, conn->out + conn->out_off, conn->out_len - conn->out_off);
+        conn->out_len -= conn->out_off;
+        conn->out_off = 0;
+    }
+    if (conn->out_len + len > conn->out_cap) {
+        conn->out_cap = conn->out_cap ? conn->out_cap * 2 : sizeof(struct msg);
+        while (conn->out_len + len > conn->out_cap) {
+            conn->out_cap *= 2;
+        }
+        conn->out = realloc(conn->out, conn->out_cap);
+        if (conn->out == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(conn->out + conn->out_len, buf, len);
+    conn->out_len += len;
+    g_queued += len;
+
+    return conn_write(i);
+}
+
+/* reads what has arrived on conns[i]. returns 1 once a whole frame is in conn->in, 0 if there's no more
+ * for now, or -1 if the server hung up */
+static int conn_read(int i)
+{
+    struct replay_conn *conn = &g_conns[i];
+    size_t want;
+    ssize_t bytes_read;
+
+    while (1) {
+        want = MSG_HEADER_SIZE;
+        if (conn->in_len >= MSG_HEADER_SIZE) {
+            if (conn->in.len >= MSG_SIZE) {
+                return -1;
+            }
+            want += conn->in.len;
+        }
+        if (conn->in_len == want) {
+            conn->in.msg[conn->in.len] = '\0';
+            conn->in_len = 0;
+            return 1;
+        }
+
+        bytes_read = read(g_fds[i].fd, ((char *)&conn->in) + conn->in_len, want - conn->in_len);
+        if (bytes_read > 0) {
+            conn->in_len += bytes_read;
+        } else if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return 0;
+        } else {
+            return -1;
+        }
+    }
+}
+
+static void record_sample(struct msg *msg, uint64_t now)
+{
+    if (g_num_samples == g_max_samples) {
+        g_max_samples = g_max_samples ? g_max_samples * 2 : 4096;
+        g_samples = realloc(g_samples, g_max_samples * sizeof(uint64_t));
+        if (g_samples == NULL) {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    g_samples[g_num_samples++] = now - msg->trace[TRACE_CLIENT_SEND];
+
+    /* only the server's stamps are there; ours stand in for the recipient's */
+    msg->trace[TRACE_CLIENT_RECV] = now;
+    for (int i = 1; i <= TRACE_CLIENT_RECV; i++) {
+        g_hop_total[i] += msg->trace[i] - msg->trace[i-1];
+    }
+}
+
+/* reads everything the server has sent and writes whatever it will take, waiting up to timeout ms for
+ * either. returns how many connections got anywhere: a frame, some bytes written, or a hangup */
+static int pump(int timeout)
+{
+    struct msg *msg;
+    uint64_t now;
+    int events = 0, ret;
+
+    if (poll(g_fds, g_num_fds, timeout) <= 0) {
+        return 0;
+    }
+    now = now_ns();
+    for (int i = 0; i < g_num_fds; i++) {
+        if (!g_fds[i].revents) {
+            continue;
+        }
+        events++;
+        ret = 0;
+        if (g_fds[i].revents & POLLOUT) {
+            ret = conn_write(i);
+        }
+        if (ret == 0 && g_fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+            /* all of it, not a frame a turn: the server may be waiting on us to take it */
+            msg = &g_conns[i].in;
+            while ((ret = conn_read(i)) == 1) {
+                g_received++;
+                g_last_recv_ns = now;
+                if (msg->trace[TRACE_CLIENT_SEND] && msg->trace[TRACE_SERVER_RECV] &&
+                        msg->trace[TRACE_SERVER_FANOUT]) {
+                    record_sample(msg, now);
+                }
+            }
+        }
+        g_fds[i].revents = 0;
+        if (ret < 0) {
+            /* the server hung up on this one; the rest of its traffic goes nowhere */
+            remove_conn(i);
+            i--;
+        }
+    }
+
+    return events;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int load_results(const char *path, double *results)
+{
+    char name[BUF_SIZE];
+    double value;
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    for (int i = 0; i < RESULT_NUM; i++) {
+        results[i] = -1;
+    }
+    while (fscanf(fp, "%1023s %lf", name, &value) == 2) {
+        for (int i = 0; i < RESULT_NUM; i++) {
+            if (strcmp(name, result_names[i]) == 0) {
+                results[i] = value;
+            }
+        }
+    }
+    fclose(fp);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    char buf[sizeof(struct msg)];
+    char *results_path = NULL, *baseline_path = NULL, *server_path;
+    struct capture_header header;
+    struct capture_record rec;
+    double results[RESULT_NUM] = { 0 }, baseline[RESULT_NUM], speed = 1;
+    uint64_t start = 0, first_ns = 0, due, now, sent = 0, skipped = 0, stamp;
+    FILE *capture, *fp;
+    int opt, i, have_baseline = 0;
+
+    while ((opt = getopt(argc, argv, "fx:o:b:")) != -1) {
+        switch (opt) {
+        case 'f':
+            speed = 0;
+            break;
+        case 'x':
+            speed = atof(optarg);
+            break;
+        case 'o':
+            results_path = optarg;
+            break;
+        case 'b':
+            baseline_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || speed < 0) {
+        usage(argv[0]);
+    }
+    server_path = argv[optind + 1];
+    if (strlen(server_path) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+        fprintf(stderr, "socket path too long\n");
+        exit(EXIT_FAILURE);
+    }
+    if (baseline_path) {
+        have_baseline = load_results(baseline_path, baseline) == 0;
+    }
+
+    capture = fopen(argv[optind], "rb");
+    if (capture == NULL) {
+        perror(argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+    if (fread(&header, sizeof(header), 1, capture) != 1 || header.magic != CAPTURE_MAGIC ||
+            header.version != CAPTURE_VERSION) {
+        fprintf(stderr, "%s: not a capture this build can read\n", argv[optind]);
+        exit(EXIT_FAILURE);
+    }
+
+    while (fread(&rec, sizeof(rec), 1, capture) == 1) {
+        if (rec.len > sizeof(buf) || (rec.event == CAPTURE_FRAME && rec.len < MSG_HEADER_SIZE) ||
+                fread(buf, 1, rec.len, capture) != rec.len) {
+            fprintf(stderr, "%s: truncated or corrupt record\n", argv[optind]);
+            break;
+        }
+
+        /* keep the captured spacing, scaled; whatever the server sends meanwhile gets read */
+        if (start == 0) {
+            start = now_ns();
+            first_ns = rec.ns;
+        }
+        if (speed > 0) {
+            due = start + (uint64_t)((rec.ns - first_ns) / speed);
+            while ((now = now_ns()) < due) {
+                pump((due - now + 999999) / 1000000);
+            }
+        }
+        pump(0);
+
+        i = find_conn(rec.user_id);
+        switch (rec.event) {
+        case CAPTURE_CONNECT:
+            if (i < 0) {
+                add_conn(server_path, rec.user_id);
+            }
+            break;
+        case CAPTURE_FRAME:
+            if (i < 0) {
+                skipped++;
+                break;
+            }
+            /* traced from here, whatever the original sender had */
+            memset(buf + offsetof(struct msg, trace), 0, sizeof(((struct msg *)0)->trace));
+            stamp = now_ns();
+            memcpy(buf + offsetof(struct msg, trace[TRACE_CLIENT_SEND]), &stamp, sizeof(stamp));
+            if (conn_send(i, buf, rec.len) < 0) {
+                remove_conn(i);
+                break;
+            }
+            sent++;
+            /* the next record mustn't overtake this one (a hangup on another connection would lose it
+             * its fanout), so it waits until the socket has all of it, reading everything meanwhile */
+            while (g_queued > 0 && g_num_fds > 0) {
+                pump(-1);
+            }
+            break;
+        case CAPTURE_DISCONNECT:
+            /* the server sees it leave, but whatever it was sent before that still gets read. as fast
+             * as we go, closing outright would throw away fanout the original client got */
+            if (i >= 0) {
+                shutdown(g_fds[i].fd, SHUT_WR);
+                g_conns[i].user_id = LEFT;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    fclose(capture);
+    now = now_ns();
+    if (skipped) {
+        fprintf(stderr, "%s: %lu frames came from connections with no connect record and weren't sent\n",
+            argv[optind], (unsigned long)skipped);
+    }
+
+    /* let fanout finish */
+    while (g_num_fds > 0 && pump(REPLAY_DRAIN_MS) > 0) {
+    }
+    while (g_num_fds > 0) {
+        remove_conn(0);
+    }
+
+    results[RESULT_FRAMES_SENT] = sent;
+    results[RESULT_FRAMES_RECEIVED] = g_received;
+    results[RESULT_FRAMES_SKIPPED] = skipped;
+    results[RESULT_SEND_SECS] = (now - start) / 1e9;
+    if (now > start) {
+        results[RESULT_SENT_PER_SEC] = sent / ((now - start) / 1e9);
+    }
+    if (g_last_recv_ns > start) {
+        results[RESULT_RECEIVED_PER_SEC] = g_received / ((g_last_recv_ns - start) / 1e9);
+    }
+    if (g_num_samples) {
+        qsort(g_samples, g_num_samples, sizeof(uint64_t), compare_u64);
+        for (size_t j = 0; j < g_num_samples; j++) {
+            results[RESULT_LATENCY_MEAN] += g_samples[j];
+        }
+        results[RESULT_LATENCY_MEAN] /= g_num_samples * 1e3;
+        results[RESULT_LATENCY_P50] = g_samples[(g_num_samples - 1) / 2] / 1e3;
+        results[RESULT_LATENCY_P99] = g_samples[(g_num_samples - 1) * 99 / 100] / 1e3;
+        results[RESULT_LATENCY_MAX] = g_samples[g_num_samples - 1] / 1e3;
+        results[RESULT_SEND_SERVER] = g_hop_total[TRACE_SERVER_RECV] / (g_num_samples * 1e3);
+        results[RESULT_SERVER_FANOUT] = g_hop_total[TRACE_SERVER_FANOUT] / (g_num_samples * 1e3);
+        results[RESULT_FANOUT_RECV] = g_hop_total[TRACE_CLIENT_RECV] / (g_num_samples * 1e3);
+    }
+
+    for (i = 0; i < RESULT_NUM; i++) {
+        printf("%-18s %12.2f", result_names[i], results[i]);
+        if (have_baseline && baseline[i] > 0) {
+            printf("  baseline %12.2f  %+7.1f%%", baseline[i], (results[i] - baseline[i]) * 100 / baseline[i]);
+        }
+        printf("\n");
+    }
+
+    if (results_path) {
+        fp = fopen(results_path, "w");
+        if (fp == NULL) {
+            perror(results_path);
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < RESULT_NUM; i++) {
+            fprintf(fp, "%s %f\n", result_names[i], results[i]);
+        }
+        fclose(fp);
+    }
+
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "jchat.h"
+
+/* framing and blocking i/o for struct msg, shared by everything that talks the protocol */
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* sets msg->len from the payload and returns the number of bytes that go on the wire. chunk payloads are
+ * raw bytes (NULs and all), so those keep the len they were given */
+size_t frame_msg(struct msg *msg)
+{
+    if (msg->type != MSG_CHUNK) {
+        msg->len = strnlen(msg->msg, MSG_SIZE - 1);
+    }
+    return MSG_HEADER_SIZE + msg->len;
+}
+
+/* blocking write of all of buf to a socket. returns -1 on error */
+int write_full(int fd, const void *buf, size_t len)
+{
+    size_t total_written = 0;
+    ssize_t bytes_written;
+
+    while (total_written < len) {
+        bytes_written = send(fd, ((const char *)buf) + total_written, len - total_written, MSG_NOSIGNAL);
+        if (bytes_written > 0) {
+            total_written += bytes_written;
+        } else {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int write_msg(int fd, struct msg *msg)
+{
+    return write_full(fd, msg, frame_msg(msg));
+}
+
+/* blocking read of len bytes. returns how many arrived before EOF or an error */
+size_t read_full(int fd, void *buf, size_t len)
+{
+    size_t total_read = 0;
+    ssize_t bytes_read;
+
+    while (total_read < len) {
+        bytes_read = read(fd, ((char *)buf) + total_read, len - total_read);
+        if (bytes_read > 0) {
+            total_read += bytes_read;
+        } else {
+            break;
+        }
+    }
+
+    return total_read;
+}
+
+/* blocking read of one frame. returns the frame size, or 0 on EOF/error/bad frame */
+int read_msg(int fd, struct msg *msg)
+{
+    if (read_full(fd, msg, MSG_HEADER_SIZE) != MSG_HEADER_SIZE || msg->len >= MSG_SIZE) {
+        return 0;
+    }
+    if (read_full(fd, msg->msg, msg->len) != msg->len) {
+        return 0;
+    }
+    msg->msg[msg->len] = '\0';
+
+    return MSG_HEADER_SIZE + msg->len;
+}
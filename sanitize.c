@@ -0,0 +1,477 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2_TARGET
+#endif
+
+#include "sanitize.h"
+
+/* everything below is about finding the end of the run of bytes that can go to the terminal once any
+ * ASCII control in them is swapped for a '?' (or a tab for a space): printable ASCII, kept newlines,
+ * ASCII controls, and well-formed UTF-8 that isn't a C1 control. a byte under 0x80 is always a
+ * character of its own, so those swaps are one for one and the scanners make them in place as they go;
+ * only a malformed sequence or a C1 control, which becomes a single '?', makes the text any shorter */
+
+#define CLEAN_BLOCK 16 /* all-ASCII bytes sanitize_text() wants to see before it goes back to a scanner */
+
+/* utf8_decode(), inlined into the loops below */
+static inline size_t decode(const unsigned char *s, size_t len, uint32_t *cp)
+{
+    size_t need, i;
+    uint32_t min;
+
+    if (s[0] < 0x80) {
+        *cp = s[0];
+        return 1;
+    } else if ((s[0] & 0xE0) == 0xC0) {
+        need = 1;
+        min = 0x80;
+        *cp = s[0] & 0x1F;
+    } else if ((s[0] & 0xF0) == 0xE0) {
+        need = 2;
+        min = 0x800;
+        *cp = s[0] & 0x0F;
+    } else if ((s[0] & 0xF8) == 0xF0) {
+        need = 3;
+        min = 0x10000;
+        *cp = s[0] & 0x07;
+    } else {
+        *cp = 0xFFFD;
+        return 1;
+    }
+
+    if (need >= len) {
+        *cp = 0xFFFD;
+        return 1;
+    }
+    for (i = 1; i <= need; i++) {
+        if ((s[i] & 0xC0) != 0x80) {
+            *cp = 0xFFFD;
+            return 1;
+        }
+        *cp = (*cp << 6) | (s[i] & 0x3F);
+    }
+    if (*cp < min || *cp > 0x10FFFF || (*cp >= 0xD800 && *cp <= 0xDFFF)) {
+        *cp = 0xFFFD;
+        return 1;
+    }
+    return need + 1;
+}
+
+/* length of the non-ASCII character at s, and (through ok) whether it can go to the terminal as it is */
+static inline size_t next_char(const unsigned char *s, size_t len, int *ok)
+{
+    uint32_t cp;
+    size_t n;
+
+    n = decode(s, len, &cp);
+    /* malformed, or a C1 control (U+0080 to U+009F, CSI among them) */
+    *ok = !(cp == 0xFFFD && n == 1) && cp >= 0xA0;
+    return n;
+}
+
+/* the byte an ASCII character goes to the terminal as */
+static inline unsigned char fix_ascii(unsigned char c, int keep_newlines)
+{
+    if ((c < 0x20 || c == 0x7F) && !(c == '\n' && keep_newlines)) {
+        return c == '\t' ? ' ' : '?';
+    }
+    return c;
+}
+
+/* scans up to the first character that can't go out as it is */
+static inline size_t scan_chars(char *s, size_t len, int keep_newlines)
+{
+    unsigned char *u = (unsigned char *)s;
+    size_t i = 0, n;
+    int ok;
+
+    while (i < len) {
+        if (u[i] < 0x80) {
+            u[i] = fix_ascii(u[i], keep_newlines);
+            i++;
+            continue;
+        }
+        n = next_char(u + i, len - i, &ok);
+        if (!ok) {
+            break;
+        }
+        i += n;
+    }
+    return i;
+}
+
+static size_t scan_scalar(char *s, size_t len, int keep_newlines)
+{
+    return scan_chars(s, len, keep_newlines);
+}
+
+/* the vector scanners below check a block at a time and stop at the first block with a bad sequence in
+ * it, or when there's less than a block left; the scalar loop takes it from there. a character can
+ * straddle where they stopped, so this backs up to its first byte */
+static size_t char_start(const unsigned char *s, size_t i)
+{
+    size_t k, need;
+
+    for (k = 1; k <= 3 && k <= i; k++) {
+        if (s[i - k] < 0x80) {
+            break;
+        }
+        if (s[i - k] >= 0xC0) {
+            need = s[i - k] >= 0xF0 ? 4 : s[i - k] >= 0xE0 ? 3 : 2;
+            return need > k ? i - k : i;
+        }
+    }
+    return i;
+}
+
+/* where a vector scanner hands over, given the first flagged byte e of the block at i (or e == 0 if
+ * it ran out of blocks). whatever is wrong starts at most 3 bytes before the byte it's flagged at */
+static inline size_t scan_rest(char *s, size_t len, size_t i, size_t e, int keep_newlines)
+{
+    i = char_start((const unsigned char *)s, e > 3 ? i + e - 3 : i);
+    return i + scan_chars(s + i, len - i, keep_newlines);
+}
+
+/* the UTF-8 checks a block needs, with b[-1], b[-2] and b[-3] shifted in from the block before it:
+ *  - a byte is a continuation (0x80-0xBF) exactly when b[-1] >= 0xC0, b[-2] >= 0xE0 or b[-3] >= 0xF0
+ *  - no lead byte that can't start a character: 0xC0, 0xC1, 0xF5 and up
+ *  - the second byte of E0 (overlong), ED (surrogate), F0 (overlong) and F4 (past U+10FFFF) in range
+ *  - no C2 80-9F, the C1 controls
+ * bytes compare as signed, so 0x80-0xBF is -128..-65 */
+
+#ifdef __SSE2__
+#define SHIFT_IN_SSE2(cur, prev, k) _mm_or_si128(_mm_slli_si128(cur, k), _mm_srli_si128(prev, 16 - (k)))
+
+/* 0xFF at the bytes of v that are printable ASCII or a kept newline */
+static inline __m128i printable_sse2(__m128i v, __m128i newline)
+{
+    __m128i ok;
+
+    ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(0x7F)), _mm_cmpgt_epi8(v, _mm_set1_epi8(0x1F)));
+    return _mm_or_si128(ok, _mm_cmpeq_epi8(v, newline));
+}
+
+/* 0xFF at the bytes of v that are ASCII controls to be swapped */
+static inline __m128i controls_sse2(__m128i v, __m128i newline)
+{
+    return _mm_andnot_si128(printable_sse2(v, newline), _mm_cmpgt_epi8(v, _mm_set1_epi8(-1)));
+}
+
+/* v with the bytes in ctrl swapped for '?', or ' ' for a tab */
+static inline __m128i fix_sse2(__m128i v, __m128i ctrl)
+{
+    __m128i tab = _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'));
+    __m128i fixed = _mm_or_si128(_mm_and_si128(tab, _mm_set1_epi8(' ')), _mm_andnot_si128(tab, _mm_set1_epi8('?')));
+
+    return _mm_or_si128(_mm_and_si128(ctrl, fixed), _mm_andnot_si128(ctrl, v));
+}
+
+/* nonzero bytes wherever the UTF-8 in block v (following prev) has something wrong */
+static inline __m128i check_sse2(__m128i v, __m128i prev)
+{
+    __m128i prev1 = SHIFT_IN_SSE2(v, prev, 1);
+    __m128i prev2 = SHIFT_IN_SSE2(v, prev, 2);
+    __m128i prev3 = SHIFT_IN_SSE2(v, prev, 3);
+    __m128i err, cont, not_needed;
+
+    /* continuations exactly where the lead bytes before them want them */
+    cont = _mm_cmpgt_epi8(_mm_set1_epi8(-64), v);
+    not_needed = _mm_or_si128(_mm_subs_epu8(prev1, _mm_set1_epi8((char)0xBF)),
+        _mm_or_si128(_mm_subs_epu8(prev2, _mm_set1_epi8((char)0xDF)),
+        _mm_subs_epu8(prev3, _mm_set1_epi8((char)0xEF))));
+    not_needed = _mm_cmpeq_epi8(not_needed, _mm_setzero_si128());
+    err = _mm_cmpeq_epi8(not_needed, cont);
+
+    /* lead bytes nothing can start with */
+    err = _mm_or_si128(err, _mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8((char)0xFE)), _mm_set1_epi8((char)0xC0)));
+    err = _mm_or_si128(err, _mm_subs_epu8(v, _mm_set1_epi8((char)0xF4)));
+
+    /* second bytes out of range for their lead */
+    err = _mm_or_si128(err, _mm_and_si128(_mm_cmpeq_epi8(prev1, _mm_set1_epi8((char)0xE0)),
+        _mm_cmpgt_epi8(_mm_set1_epi8((char)0xA0), v)));
+    err = _mm_or_si128(err, _mm_and_si128(_mm_cmpeq_epi8(prev1, _mm_set1_epi8((char)0xED)),
+        _mm_cmpgt_epi8(v, _mm_set1_epi8((char)0x9F))));
+    err = _mm_or_si128(err, _mm_and_si128(_mm_cmpeq_epi8(prev1, _mm_set1_epi8((char)0xF0)),
+        _mm_cmpgt_epi8(_mm_set1_epi8((char)0x90), v)));
+    err = _mm_or_si128(err, _mm_and_si128(_mm_cmpeq_epi8(prev1, _mm_set1_epi8((char)0xF4)),
+        _mm_cmpgt_epi8(v, _mm_set1_epi8((char)0x8F))));
+    err = _mm_or_si128(err, _mm_and_si128(_mm_cmpeq_epi8(prev1, _mm_set1_epi8((char)0xC2)),
+        _mm_cmpgt_epi8(_mm_set1_epi8((char)0xA0), v)));
+
+    return err;
+}
+
+static size_t scan_sse2(char *s, size_t len, int keep_newlines)
+{
+    const __m128i newline = _mm_set1_epi8(keep_newlines ? '\n' : ' ');
+    __m128i v, ctrl, prev = _mm_setzero_si128();
+    unsigned int mask = 0xFFFF;
+    size_t i;
+
+    /* printable ASCII first, which needs nothing else */
+    for (i = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(s + i));
+        if (_mm_movemask_epi8(printable_sse2(v, newline)) != 0xFFFF) {
+            break;
+        }
+        prev = v;
+    }
+    /* then the rest, with the UTF-8 checks */
+    for (; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(s + i));
+        ctrl = controls_sse2(v, newline);
+        if (_mm_movemask_epi8(ctrl)) {
+            _mm_storeu_si128((__m128i *)(s + i), fix_sse2(v, ctrl));
+        }
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(check_sse2(v, prev), _mm_setzero_si128()));
+        if (mask != 0xFFFF) {
+            break;
+        }
+        prev = v;
+    }
+    return scan_rest(s, len, i, mask != 0xFFFF ? __builtin_ctz(~mask) : 0, keep_newlines);
+}
+#endif
+
+#ifdef HAVE_AVX2_TARGET
+/* with AVX2 the UTF-8 checks come from three 16-entry tables (vpshufb): one bit per kind of error, set
+ * in the entry for the high nibble of b[-1], the low nibble of b[-1] and the high nibble of b, so a bit
+ * survives the and of all three only where that pair of bytes is wrong. two bits are shared, being
+ * told apart by the nibbles. what pairs can't show (a third or fourth byte where one is wanted) is the
+ * 0x80 bit, checked against b[-2] and b[-3]. this is the lookup from Keiser and Lemire's "Validating
+ * UTF-8 In Less Than One Instruction Per Byte". only called once sanitize_init() has seen AVX2 */
+#define TOO_SHORT (1 << 0)      /* a lead or ASCII byte where a continuation is wanted */
+#define TOO_LONG (1 << 1)       /* a continuation after ASCII */
+#define OVERLONG_3 (1 << 2)     /* E0 80-9F */
+#define TOO_LARGE (1 << 3)      /* F4 90-BF, F5 and up */
+#define SURROGATE (1 << 4)      /* ED A0-BF */
+#define OVERLONG_2 (1 << 5)     /* C0, C1 */
+#define TOO_LARGE_1000 (1 << 6) /* F5 and up, followed by 80-8F */
+#define OVERLONG_4 (1 << 6)     /* F0 80-8F */
+#define TWO_CONTS (1 << 7)      /* a continuation after a continuation: fine if it's a third or fourth byte */
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+/* alignr works within 128-bit lanes, so the bytes shifted in come from a vector straddling prev and cur */
+#define SHIFT_IN_AVX2(cur, prev, k) \
+    _mm256_alignr_epi8(cur, _mm256_permute2x128_si256(prev, cur, 0x21), 16 - (k))
+
+#define TABLE_AVX2(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+
+__attribute__((target("avx2")))
+static inline __m256i printable_avx2(__m256i v, __m256i newline)
+{
+    __m256i ok;
+
+    ok = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7F)), _mm256_cmpgt_epi8(v, _mm256_set1_epi8(0x1F)));
+    return _mm256_or_si256(ok, _mm256_cmpeq_epi8(v, newline));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i controls_avx2(__m256i v, __m256i newline)
+{
+    return _mm256_andnot_si256(printable_avx2(v, newline), _mm256_cmpgt_epi8(v, _mm256_set1_epi8(-1)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i fix_avx2(__m256i v, __m256i ctrl)
+{
+    __m256i fixed = _mm256_blendv_epi8(_mm256_set1_epi8('?'), _mm256_set1_epi8(' '),
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+
+    return _mm256_blendv_epi8(v, fixed, ctrl);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i check_avx2(__m256i v, __m256i prev)
+{
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i byte_1_high = TABLE_AVX2(
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        TOO_SHORT | OVERLONG_2,
+        TOO_SHORT,
+        TOO_SHORT | OVERLONG_3 | SURROGATE,
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+    const __m256i byte_1_low = TABLE_AVX2(
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+        CARRY | OVERLONG_2,
+        CARRY,
+        CARRY,
+        CARRY | TOO_LARGE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000);
+    const __m256i byte_2_high = TABLE_AVX2(
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);
+    __m256i prev1 = SHIFT_IN_AVX2(v, prev, 1);
+    __m256i err, must23;
+
+    err = _mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+    err = _mm256_and_si256(err, _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, nibble)));
+    err = _mm256_and_si256(err, _mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+
+    /* 0x80 where b[-2] >= 0xE0 or b[-3] >= 0xF0 */
+    must23 = _mm256_or_si256(_mm256_subs_epu8(SHIFT_IN_AVX2(v, prev, 2), _mm256_set1_epi8(0xE0 - 0x80)),
+        _mm256_subs_epu8(SHIFT_IN_AVX2(v, prev, 3), _mm256_set1_epi8(0xF0 - 0x80)));
+    err = _mm256_xor_si256(err, _mm256_and_si256(must23, _mm256_set1_epi8((char)0x80)));
+
+    /* C2 80-9F, the C1 controls */
+    return _mm256_or_si256(err, _mm256_and_si256(_mm256_cmpeq_epi8(prev1, _mm256_set1_epi8((char)0xC2)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8((char)0xA0), v)));
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(char *s, size_t len, int keep_newlines)
+{
+    const __m256i newline = _mm256_set1_epi8(keep_newlines ? '\n' : ' ');
+    __m256i v, v2, ok, ctrl, prev = _mm256_setzero_si256();
+    unsigned int mask = 0xFFFFFFFFU;
+    size_t i = 0;
+
+    /* two vectors a round while they're both printable ASCII */
+    for (; i + 64 <= len; i += 64) {
+        v = _mm256_loadu_si256((const __m256i *)(s + i));
+        v2 = _mm256_loadu_si256((const __m256i *)(s + i + 32));
+        ok = _mm256_and_si256(printable_avx2(v, newline), printable_avx2(v2, newline));
+        if ((unsigned int)_mm256_movemask_epi8(ok) != 0xFFFFFFFFU) {
+            break;
+        }
+        prev = v2;
+    }
+    /* then a vector at a time with the UTF-8 checks. no shortcut for ASCII vectors here: in mixed text
+     * the branch would go either way and cost more than it saves */
+    for (; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *)(s + i));
+        ctrl = controls_avx2(v, newline);
+        if (!_mm256_testz_si256(ctrl, ctrl)) {
+            _mm256_storeu_si256((__m256i *)(s + i), fix_avx2(v, ctrl));
+        }
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(check_avx2(v, prev), _mm256_setzero_si256()));
+        if (mask != 0xFFFFFFFFU) {
+            break;
+        }
+        prev = v;
+    }
+    return scan_rest(s, len, i, mask != 0xFFFFFFFFU ? __builtin_ctz(~mask) : 0, keep_newlines);
+}
+#endif
+
+#ifdef __SSE2__
+static size_t (*g_scan)(char *, size_t, int) = scan_sse2;
+#else
+static size_t (*g_scan)(char *, size_t, int) = scan_scalar;
+#endif
+
+void sanitize_init(void)
+{
+#ifdef HAVE_AVX2_TARGET
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        g_scan = scan_avx2;
+    }
+#endif
+}
+
+int sanitize_use(enum sanitize_impl impl)
+{
+    switch (impl) {
+    case SANITIZE_SCALAR:
+        g_scan = scan_scalar;
+        return 1;
+    case SANITIZE_SSE2:
+#ifdef __SSE2__
+        g_scan = scan_sse2;
+        return 1;
+#else
+        return 0;
+#endif
+    case SANITIZE_AVX2:
+#ifdef HAVE_AVX2_TARGET
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            g_scan = scan_avx2;
+            return 1;
+        }
+#endif
+        return 0;
+    }
+    return 0;
+}
+
+size_t utf8_decode(const char *str, size_t len, uint32_t *cp)
+{
+    return decode((const unsigned char *)str, len, cp);
+}
+
+/* whether the CLEAN_BLOCK bytes at s are all ASCII, which any scanner gets through without stopping */
+static inline int ascii_block(const unsigned char *s)
+{
+    uint64_t a, b;
+
+    memcpy(&a, s, 8);
+    memcpy(&b, s + 8, 8);
+    return ((a | b) & 0x8080808080808080ULL) == 0;
+}
+
+size_t sanitize_text(char *buf, size_t len, int keep_newlines)
+{
+    unsigned char *u = (unsigned char *)buf;
+    size_t in, out, n, check;
+    int ok;
+
+    in = out = g_scan(buf, len, keep_newlines);
+    while (in < len) {
+        /* a malformed sequence or a C1 control, which becomes one '?' however many bytes it is. they come
+         * in clusters, so from here it's a character at a time, copying down over the bytes already
+         * dropped, until a block of plain ASCII says a scanner would get somewhere again */
+        check = in;
+        while (in < len) {
+            if (in >= check) {
+                if (len - in >= CLEAN_BLOCK && ascii_block(u + in)) {
+                    break;
+                }
+                check = in + CLEAN_BLOCK;
+            }
+            if (u[in] < 0x80) {
+                u[out++] = fix_ascii(u[in++], keep_newlines);
+                continue;
+            }
+            n = next_char(u + in, len - in, &ok);
+            if (!ok) {
+                u[out++] = '?';
+                in += n;
+                continue;
+            }
+            while (n--) {
+                u[out++] = u[in++];
+            }
+        }
+
+        n = g_scan(buf + in, len - in, keep_newlines);
+        memmove(buf + out, buf + in, n);
+        in += n;
+        out += n;
+    }
+
+    return out;
+}
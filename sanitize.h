@@ -0,0 +1,28 @@
+#ifndef SANITIZE_H
+#define SANITIZE_H
+
+/* making text from other users safe to print: control characters (C0 and C1) and malformed UTF-8 are
+ * replaced with '?', tabs become spaces, and newlines are kept if asked for. nothing that reaches the
+ * terminal can move the cursor, retitle the window or reset it */
+
+/* which byte scanner sanitize_text() uses for its fast path */
+enum sanitize_impl {
+    SANITIZE_SCALAR,
+    SANITIZE_SSE2,
+    SANITIZE_AVX2
+};
+
+/* decodes one code point and returns how many bytes it used. a malformed sequence decodes as U+FFFD one
+ * byte at a time, which is what terminals draw for it */
+size_t utf8_decode(const char *s, size_t len, uint32_t *cp);
+
+/* picks the fastest scanner this cpu has. call before starting any threads */
+void sanitize_init(void);
+
+/* forces a scanner (for benchmarking). returns 0 if it isn't available here */
+int sanitize_use(enum sanitize_impl impl);
+
+/* sanitizes buf in place and returns the new length, which is never longer. doesn't terminate it */
+size_t sanitize_text(char *buf, size_t len, int keep_newlines);
+
+#endif /* SANITIZE_H */
@@ -0,0 +1,1211 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "jchat.h"
+#include "sanitize.h"
+
+/* the server: one poll loop multiplexing every client's frames. runs on a thread inside the first
+ * client (jchat), or on its own (jchatd) */
+
+/* copies src into dst with surrounding whitespace trimmed. src is a nick field off the wire, so it needn't
+ * be terminated; nothing past its NICK_SIZE bytes is looked at. returns the trimmed length */
+static size_t trim_nick(char *dst, const char *src)
+{
+    size_t start = 0, len = strnlen(src, NICK_SIZE);
+
+    while (start < len && isspace((unsigned char)src[start])) {
+        start++;
+    }
+    len -= start;
+    if (len > NICK_SIZE-1) {
+        len = NICK_SIZE-1;
+    }
+    while (len > 0 && isspace((unsigned char)src[start + len - 1])) {
+        len--;
+    }
+    memcpy(dst, src + start, len);
+    dst[len] = '\0';
+
+    return len;
+}
+
+/* registry key: trimmed + case-folded */
+static size_t normalize_nick(char *key, const char *nick)
+{
+    size_t len = trim_nick(key, nick);
+
+    for (size_t i = 0; i < len; i++) {
+        key[i] = tolower((unsigned char)key[i]);
+    }
+
+    return len;
+}
+
+static uint32_t nick_hash(const char *key)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+
+    while (*key) {
+        hash ^= (unsigned char)*key++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+void nick_registry_init(struct nick_registry *reg, uint32_t capacity)
+{
+    uint32_t size = 16;
+
+    /* keep the load factor at or below 0.5 */
+    while (size < capacity * 2) {
+        size <<= 1;
+    }
+    reg->buckets = calloc(size, sizeof(struct conn *));
+    if (reg->buckets == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    reg->mask = size - 1;
+}
+
+struct conn *nick_lookup(struct nick_registry *reg, const char *key)
+{
+    struct conn *iter = reg->buckets[nick_hash(key) & reg->mask];
+
+    while (iter && strcmp(iter->nick_key, key) != 0) {
+        iter = iter->nick_next;
+    }
+
+    return iter;
+}
+
+void nick_insert(struct nick_registry *reg, struct conn *conn)
+{
+    struct conn **bucket = &reg->buckets[nick_hash(conn->nick_key) & reg->mask];
+
+    conn->nick_next = *bucket;
+    *bucket = conn;
+}
+
+void nick_remove(struct nick_registry *reg, struct conn *conn)
+{
+    struct conn **iter;
+
+    if (conn->nick[0] == '\0') {
+        return;
+    }
+
+    iter = &reg->buckets[nick_hash(conn->nick_key) & reg->mask];
+    while (*iter && *iter != conn) {
+        iter = &(*iter)->nick_next;
+    }
+    if (*iter) {
+        *iter = conn->nick_next;
+    }
+    conn->nick_next = NULL;
+}
+
+/* claims nick for conn (releasing any nick it held). returns 0 if the nick is empty or held by someone else */
+int nick_claim(struct nick_registry *reg, struct conn *conn, const char *nick)
+{
+    char clean[NICK_SIZE];
+    char key[NICK_SIZE];
+    struct conn *owner;
+
+    /* a nick goes out in every message and notice, so control characters never make it in */
+    clean[sanitize_text(clean, trim_nick(clean, nick), 0)] = '\0';
+    nick = clean;
+    if (normalize_nick(key, nick) == 0) {
+        return 0;
+    }
+
+    owner = nick_lookup(reg, key);
+    if (owner && owner != conn) {
+        return 0;
+    }
+
+    nick_remove(reg, conn);
+    trim_nick(conn->nick, nick);
+    memcpy(conn->nick_key, key, NICK_SIZE);
+    nick_insert(reg, conn);
+
+    return 1;
+}
+
+/* nonblocking read into conn->in. returns 1 once a whole frame is there, 0 if more is needed, -1 on EOF/error */
+static int conn_read(struct conn *conn)
+{
+    size_t want;
+    ssize_t bytes_read;
+
+    while (1) {
+        want = MSG_HEADER_SIZE;
+        if (conn->in_len >= MSG_HEADER_SIZE) {
+            if (conn->in.len >= MSG_SIZE) {
+                /* not something we sent */
+                return -1;
+            }
+            want += conn->in.len;
+        }
+        if (conn->in_len == want) {
+            conn->in.msg[conn->in.len] = '\0';
+            conn->in_len = 0;
+            return 1;
+        }
+
+        bytes_read = read(conn->fd, ((char *)&conn->in) + conn->in_len, want - conn->in_len);
+        if (bytes_read > 0) {
+            conn->in_len += bytes_read;
+        } else if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            return 0;
+        } else {
+            return -1;
+        }
+    }
+}
+
+/* copies msg into a frame shared by everyone it's queued for. traced frames are stamped here, once,
+ * as fanout hands them to the recipients' queues; the bytes never change after that */
+static struct frame *frame_new(struct msg *msg)
+{
+    size_t len = frame_msg(msg);
+    struct frame *frame = malloc(sizeof(struct frame) + len);
+
+    if (frame == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    if (msg->trace[TRACE_CLIENT_SEND]) {
+        msg->trace[TRACE_SERVER_FANOUT] = now_ns();
+    }
+    frame->refs = 0;
+    frame->len = len;
+    memcpy(frame->data, msg, len);
+
+    return frame;
+}
+
+static void frame_put(struct frame *frame)
+{
+    if (--frame->refs == 0) {
+        free(frame);
+    }
+}
+
+static void conn_enqueue(struct conn *conn, struct frame *frame, enum outq_type type)
+{
+    struct outq *q = &conn->out[type];
+    struct outq_node *node = malloc(sizeof(struct outq_node));
+
+    if (node == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    node->frame = frame;
+    node->next = NULL;
+    frame->refs++;
+
+    if (q->tail) {
+        q->tail->next = node;
+    } else {
+        q->head = node;
+    }
+    q->tail = node;
+    q->bytes += frame->len;
+}
+
+static int conn_has_output(struct conn *conn)
+{
+    return conn->sending || conn->out[OUTQ_NORMAL].head || conn->out[OUTQ_BULK].head;
+}
+
+/* writes as much queued output as the socket takes, normal traffic first. returns -1 on error */
+static int conn_flush(struct conn *conn)
+{
+    struct outq *q;
+    struct frame *frame;
+    ssize_t bytes_written;
+    int i;
+
+    while (1) {
+        if (conn->sending == NULL) {
+            for (i = 0; i < OUTQ_NUM && conn->sending == NULL; i++) {
+                q = &conn->out[i];
+                if (q->head) {
+                    conn->sending = q->head;
+                    q->head = q->head->next;
+                    if (q->head == NULL) {
+                        q->tail = NULL;
+                    }
+                    q->bytes -= conn->sending->frame->len;
+                }
+            }
+            if (conn->sending == NULL) {
+                return 0;
+            }
+            conn->sending_off = 0;
+        }
+
+        frame = conn->sending->frame;
+        bytes_written = send(conn->fd, frame->data + conn->sending_off,
+            frame->len - conn->sending_off, MSG_NOSIGNAL);
+        if (bytes_written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return 0;
+            }
+            return -1;
+        }
+
+        conn->sending_off += bytes_written;
+        if (conn->sending_off == frame->len) {
+            frame_put(frame);
+            free(conn->sending);
+            conn->sending = NULL;
+        }
+    }
+}
+
+static void conn_free(struct conn *conn)
+{
+    struct outq_node *node, *next;
+
+    if (conn->sending) {
+        frame_put(conn->sending->frame);
+        free(conn->sending);
+    }
+    for (int i = 0; i < OUTQ_NUM; i++) {
+        for (node = conn->out[i].head; node; node = next) {
+            next = node->next;
+            frame_put(node->frame);
+            free(node);
+        }
+    }
+    free(conn);
+}
+
+/* queues msg for one client */
+static void server_send(struct server *srv, struct conn *conn, struct msg *msg)
+{
+    struct frame *frame = frame_new(msg);
+
+    conn_enqueue(conn, frame, OUTQ_NORMAL);
+    srv->stats.msgs_out++;
+    srv->stats.bytes_out += frame->len;
+}
+
+/* queues msg for every joined client but `except` (NULL to include the one it came from) */
+static void server_broadcast(struct server *srv, struct msg *msg, struct conn *except)
+{
+    struct frame *frame = frame_new(msg);
+    enum outq_type type = msg->type == MSG_CHUNK ? OUTQ_BULK : OUTQ_NORMAL;
+
+    for (int j = SERVER_FD_FIRST_CONN; j < srv->num_fds; j++) {
+        if (srv->conns[j]->nick[0] != '\0' && srv->conns[j] != except) {
+            conn_enqueue(srv->conns[j], frame, type);
+            srv->stats.msgs_out++;
+            srv->stats.bytes_out += frame->len;
+        }
+    }
+
+    if (frame->refs == 0) {
+        free(frame);
+    }
+}
+
+static void bucket_init(struct token_bucket *bucket, uint32_t rate, uint32_t burst, uint64_t now)
+{
+    bucket->rate = rate;
+    bucket->burst = burst;
+    bucket->tokens = burst;
+    bucket->last_ns = now;
+}
+
+/* refills the bucket and returns ns until `cost` tokens are available (0 if they are now) */
+static uint64_t bucket_wait(struct token_bucket *bucket, double cost, uint64_t now)
+{
+    if (bucket->rate == 0) {
+        return 0;
+    }
+
+    bucket->tokens += (now - bucket->last_ns) * bucket->rate / 1e9;
+    if (bucket->tokens > bucket->burst) {
+        bucket->tokens = bucket->burst;
+    }
+    bucket->last_ns = now;
+
+    if (bucket->tokens >= cost) {
+        return 0;
+    }
+    return (uint64_t)((cost - bucket->tokens) * 1e9 / bucket->rate) + 1;
+}
+
+/* charges the frame in conn->in to the client's buckets. returns 1 if it can be handled now. otherwise the
+ * frame is held and reads from this client pause until it can be, so the kernel pushes back on the sender */
+static int server_admit(struct server *srv, struct conn *conn, uint64_t now)
+{
+    struct msg *msg = &conn->in;
+    struct msg notice = {0};
+    /* a chunked message costs one message, however many frames it takes */
+    double msgs = (msg->type == MSG_CHUNK && msg->chunk_offset != 0) ? 0 : 1;
+    double bytes = MSG_HEADER_SIZE + msg->len;
+    uint64_t wait_msgs, wait_bytes;
+
+    wait_msgs = bucket_wait(&conn->msg_bucket, msgs, now);
+    wait_bytes = bucket_wait(&conn->byte_bucket, bytes, now);
+
+    if ((wait_msgs == 0 && wait_bytes == 0) || conn->hung_up) {
+        if (conn->msg_bucket.rate) {
+            conn->msg_bucket.tokens -= msgs;
+        }
+        if (conn->byte_bucket.rate) {
+            conn->byte_bucket.tokens -= bytes;
+        }
+        if (conn->held) {
+            srv->stats.deferred_ns += now - conn->held_since;
+            conn->held = 0;
+        }
+        srv->stats.msgs_in++;
+        srv->stats.bytes_in += bytes;
+        return 1;
+    }
+
+    if (!conn->held) {
+        conn->held = 1;
+        conn->held_since = now;
+        srv->stats.rate_limited++;
+        if (conn->nick[0] != '\0' && now - conn->limit_notice_ns >= RATE_LIMIT_NOTICE_MS * 1000000ULL) {
+            notice.type = MSG_RATE_LIMITED;
+            notice.time = time(NULL);
+            notice.user_id = conn->user_id;
+            snprintf(notice.msg, sizeof(notice.msg), "you're sending faster than the server allows; slowing you down");
+            server_send(srv, conn, &notice);
+            conn->limit_notice_ns = now;
+        }
+    }
+    conn->held_until = now + (wait_msgs > wait_bytes ? wait_msgs : wait_bytes);
+
+    return 0;
+}
+
+static void server_format_stats(struct server *srv, char *buf, size_t len)
+{
+    uint64_t now = now_ns();
+
+    snprintf(buf, len, "server: up %lus, %d clients, in %lu msgs/%lu bytes, out %lu msgs/%lu bytes, "
+        "rate limited %lu times (%.1fms deferred), %lu slow clients dropped",
+        (unsigned long)((now - srv->stats.start_ns) / 1000000000ULL), srv->num_fds - SERVER_FD_FIRST_CONN,
+        (unsigned long)srv->stats.msgs_in, (unsigned long)srv->stats.bytes_in,
+        (unsigned long)srv->stats.msgs_out, (unsigned long)srv->stats.bytes_out,
+        (unsigned long)srv->stats.rate_limited, srv->stats.deferred_ns / 1e6,
+        (unsigned long)srv->stats.dropped);
+}
+
+/* appends an event on conn to the capture file, if we're keeping one. a CAPTURE_FRAME is msg as it
+ * arrived, before limits or anything else touch it; other events have no msg */
+static void server_capture(struct server *srv, struct conn *conn, enum capture_event event, const struct msg *msg)
+{
+    struct capture_record rec;
+    FILE *fp = srv->config->capture;
+
+    if (fp == NULL) {
+        return;
+    }
+    rec.ns = now_ns() - srv->stats.start_ns;
+    rec.user_id = conn->user_id;
+    rec.event = event;
+    rec.len = msg ? MSG_HEADER_SIZE + msg->len : 0;
+    if (fwrite(&rec, sizeof(rec), 1, fp) != 1 || fwrite(msg, 1, rec.len, fp) != rec.len) {
+        /* losing the capture shouldn't take the room down with it */
+        perror("capture");
+        srv->config->capture = NULL;
+    }
+}
+
+static void server_remove_conn(struct server *srv, int i)
+{
+    struct conn *conn = srv->conns[i];
+    struct msg msg = {0};
+
+    if (!srv->config->handed_off) {
+        server_capture(srv, conn, CAPTURE_DISCONNECT, NULL);
+        if (conn->nick[0] != '\0' && !conn->left) {
+            /* gone without a word (crashed, killed, dropped for a full queue): say so for it, or the
+             * others hold on to its typing state and any paste it was halfway through for good */
+            msg.type = MSG_QUIT;
+            msg.time = time(NULL);
+            msg.user_id = conn->user_id;
+            memcpy(msg.nick, conn->nick, NICK_SIZE);
+            snprintf(msg.msg, sizeof(msg.msg), "%s left the chat!", conn->nick);
+            server_broadcast(srv, &msg, conn);
+        }
+    }
+    close(srv->fds[i].fd);
+    nick_remove(&srv->nick_registry, srv->conns[i]);
+    conn_free(srv->conns[i]);
+
+    /* consolidate lists */
+    srv->num_fds--;
+    srv->fds[i] = srv->fds[srv->num_fds];
+    srv->conns[i] = srv->conns[srv->num_fds];
+    srv->conns[srv->num_fds] = NULL;
+}
+
+/* hangs up on everyone and frees the server. whatever can still be written without blocking goes out
+ * first; clients see EOF and exit like they would if the server had crashed, minus the lost messages.
+ * after a handoff only our copies of the sockets are closed and the clients never notice */
+static void server_shutdown(struct server *srv)
+{
+    close(srv->fds[SERVER_FD_LISTEN].fd);
+    while (srv->num_fds > SERVER_FD_FIRST_CONN) {
+        if (!srv->config->handed_off) {
+            conn_flush(srv->conns[SERVER_FD_FIRST_CONN]);
+        }
+        /* everyone's going; nobody to tell */
+        srv->conns[SERVER_FD_FIRST_CONN]->left = 1;
+        server_remove_conn(srv, SERVER_FD_FIRST_CONN);
+    }
+    if (srv->config->capture) {
+        fflush(srv->config->capture);
+    }
+    free(srv->nick_registry.buckets);
+    free(srv->fds);
+    free(srv->conns);
+    free(srv);
+}
+
+/* sends all of buf with fds attached to its first byte. returns -1 on error */
+static int send_with_fds(int sock, const void *buf, size_t len, const int *fds, int num_fds)
+{
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+    struct msghdr mh = { 0 };
+    struct cmsghdr *cmsg;
+    ssize_t sent;
+
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = CMSG_SPACE(num_fds * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(num_fds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, num_fds * sizeof(int));
+
+    sent = sendmsg(sock, &mh, MSG_NOSIGNAL);
+    if (sent < 0) {
+        return -1;
+    }
+    return write_full(sock, (const char *)buf + sent, len - sent);
+}
+
+/* reads exactly len bytes, keeping up to max_fds descriptors that came with them. returns how many
+ * did, or -1 on error */
+static int recv_with_fds(int sock, void *buf, size_t len, int *fds, int max_fds)
+{
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov;
+    struct msghdr mh;
+    struct cmsghdr *cmsg;
+    size_t got = 0;
+    ssize_t bytes_read;
+    int num_fds = 0, fd;
+
+    while (got < len) {
+        /* never ask for more than this record, or the next one's fds would land here */
+        iov.iov_base = (char *)buf + got;
+        iov.iov_len = len - got;
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+
+        bytes_read = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+        if (bytes_read <= 0) {
+            return -1;
+        }
+        for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            for (size_t i = 0; i < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++) {
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if (num_fds < max_fds) {
+                    fds[num_fds++] = fd;
+                } else {
+                    close(fd);
+                }
+            }
+        }
+        got += bytes_read;
+    }
+
+    return num_fds;
+}
+
+/* hot restart, old side: a replacement connected to the control socket. hands it the listening sockets
+ * and every client with its nick, limits and unsent output, then waits for it to say it has them all.
+ * returns 1 once it has; on any failure we keep serving and the replacement's copies go away with it */
+static int server_handoff(struct server *srv)
+{
+    struct handoff_header header = { 0 };
+    struct handoff_conn rec;
+    struct timeval timeout = { HANDOFF_TIMEOUT_MS / 1000, (HANDOFF_TIMEOUT_MS % 1000) * 1000 };
+    struct conn *conn;
+    struct outq_node *node;
+    uint64_t start = now_ns();
+    uint32_t len;
+    int fd, fds[2];
+    char ack;
+
+    fd = accept(srv->config->control_fd, NULL, NULL);
+    if (fd < 0) {
+        return 0;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    header.magic = HANDOFF_MAGIC;
+    header.version = HANDOFF_VERSION;
+    header.num_conns = srv->num_fds - SERVER_FD_FIRST_CONN;
+    header.next_user_id = srv->next_user_id;
+    header.sock = srv->config->sock;
+    header.stats = srv->stats;
+    fds[0] = srv->fds[SERVER_FD_LISTEN].fd;
+    fds[1] = srv->config->control_fd;
+    if (send_with_fds(fd, &header, sizeof(header), fds, 2) < 0) {
+        goto failed;
+    }
+
+    for (int i = SERVER_FD_FIRST_CONN; i < srv->num_fds; i++) {
+        conn = srv->conns[i];
+        /* whatever goes out now doesn't have to be copied */
+        conn_flush(conn);
+
+        memset(&rec, 0, sizeof(rec));
+        rec.user_id = conn->user_id;
+        memcpy(rec.nick, conn->nick, NICK_SIZE);
+        rec.in_len = conn->held ? MSG_HEADER_SIZE + conn->in.len : conn->in_len;
+        rec.chunk_id = conn->chunk_id;
+        rec.chunk_left = conn->chunk_left;
+        rec.typing_pending = conn->typing_pending;
+        rec.typing_sent_ns = conn->typing_sent_ns;
+        rec.msg_bucket = conn->msg_bucket;
+        rec.byte_bucket = conn->byte_bucket;
+        rec.held = conn->held;
+        rec.hung_up = conn->hung_up;
+        rec.held_since = conn->held_since;
+        rec.held_until = conn->held_until;
+        rec.limit_notice_ns = conn->limit_notice_ns;
+        if (conn->sending) {
+            rec.sending_len = conn->sending->frame->len - conn->sending_off;
+        }
+        for (int q = 0; q < OUTQ_NUM; q++) {
+            for (node = conn->out[q].head; node; node = node->next) {
+                rec.num_frames[q]++;
+            }
+        }
+
+        if (send_with_fds(fd, &rec, sizeof(rec), &conn->fd, 1) < 0 ||
+                write_full(fd, &conn->in, rec.in_len) < 0) {
+            goto failed;
+        }
+        if (conn->sending &&
+                write_full(fd, conn->sending->frame->data + conn->sending_off, rec.sending_len) < 0) {
+            goto failed;
+        }
+        for (int q = 0; q < OUTQ_NUM; q++) {
+            for (node = conn->out[q].head; node; node = node->next) {
+                len = node->frame->len;
+                if (write_full(fd, &len, sizeof(len)) < 0 || write_full(fd, node->frame->data, len) < 0) {
+                    goto failed;
+                }
+            }
+        }
+    }
+
+    /* only let go once it has everything */
+    if (read(fd, &ack, 1) != 1) {
+        goto failed;
+    }
+    close(fd);
+    srv->config->handed_off = 1;
+    printf("handed %u clients off in %.3fms\n", header.num_conns, (now_ns() - start) / 1e6);
+    return 1;
+
+failed:
+    perror("hot restart");
+    close(fd);
+    return 0;
+}
+
+/* reads a frame of len bytes off the control socket */
+static struct frame *frame_recv(int fd, uint32_t len)
+{
+    struct frame *frame;
+
+    if (len > sizeof(struct msg)) {
+        fprintf(stderr, "hot restart: bad frame length %u\n", len);
+        exit(EXIT_FAILURE);
+    }
+    frame = malloc(sizeof(struct frame) + len);
+    if (frame == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    if (read_full(fd, frame->data, len) != len) {
+        perror("hot restart");
+        exit(EXIT_FAILURE);
+    }
+    frame->refs = 0;
+    frame->len = len;
+
+    return frame;
+}
+
+/* hot restart, new side: the first part of what the old server sends. adopts its control socket and
+ * returns its listening socket; header says how many clients follow */
+static int server_takeover_header(struct server_config *config, struct handoff_header *header)
+{
+    struct timeval timeout = { HANDOFF_TIMEOUT_MS / 1000, (HANDOFF_TIMEOUT_MS % 1000) * 1000 };
+    int fds[2];
+
+    setsockopt(config->takeover_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (recv_with_fds(config->takeover_fd, header, sizeof(*header), fds, 2) != 2) {
+        perror("hot restart");
+        exit(EXIT_FAILURE);
+    }
+    if (header->magic != HANDOFF_MAGIC || header->version != HANDOFF_VERSION) {
+        fprintf(stderr, "hot restart: the running server speaks a different handoff version\n");
+        exit(EXIT_FAILURE);
+    }
+    config->sock = header->sock;
+    if (config->control_fd >= 0) {
+        close(config->control_fd);
+    }
+    config->control_fd = fds[1];
+    if (config->max_users < header->num_conns) {
+        config->max_users = header->num_conns;
+    }
+
+    return fds[0];
+}
+
+/* hot restart, new side: rebuilds every client the old server had, then tells it to let go */
+static void server_takeover(struct server *srv, struct handoff_header *header)
+{
+    struct server_config *config = srv->config;
+    struct handoff_conn rec;
+    struct conn *conn;
+    struct frame *frame;
+    uint32_t len;
+    int fd = config->takeover_fd, client_fd;
+
+    srv->next_user_id = header->next_user_id;
+    srv->stats = header->stats;
+
+    for (uint32_t n = 0; n < header->num_conns; n++) {
+        if (recv_with_fds(fd, &rec, sizeof(rec), &client_fd, 1) != 1 || rec.in_len > sizeof(struct msg)) {
+            perror("hot restart");
+            exit(EXIT_FAILURE);
+        }
+        conn = calloc(1, sizeof(struct conn));
+        if (conn == NULL) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        conn->fd = client_fd;
+        conn->user_id = rec.user_id;
+        if (read_full(fd, &conn->in, rec.in_len) != rec.in_len) {
+            perror("hot restart");
+            exit(EXIT_FAILURE);
+        }
+        conn->in_len = rec.held ? 0 : rec.in_len;
+        conn->chunk_id = rec.chunk_id;
+        conn->chunk_left = rec.chunk_left;
+        conn->typing_pending = rec.typing_pending;
+        conn->typing_sent_ns = rec.typing_sent_ns;
+        conn->held = rec.held;
+        conn->hung_up = rec.hung_up;
+        conn->held_since = rec.held_since;
+        conn->held_until = rec.held_until;
+        conn->limit_notice_ns = rec.limit_notice_ns;
+
+        /* keep the tokens it had, under this server's limits */
+        conn->msg_bucket = rec.msg_bucket;
+        conn->msg_bucket.rate = config->rate_msgs;
+        conn->msg_bucket.burst = config->burst_msgs;
+        if (conn->msg_bucket.tokens > conn->msg_bucket.burst) {
+            conn->msg_bucket.tokens = conn->msg_bucket.burst;
+        }
+        conn->byte_bucket = rec.byte_bucket;
+        conn->byte_bucket.rate = config->rate_bytes;
+        conn->byte_bucket.burst = config->burst_bytes;
+        if (conn->byte_bucket.tokens > conn->byte_bucket.burst) {
+            conn->byte_bucket.tokens = conn->byte_bucket.burst;
+        }
+
+        if (rec.nick[0]) {
+            memcpy(conn->nick, rec.nick, NICK_SIZE);
+            conn->nick[NICK_SIZE - 1] = '\0';
+            normalize_nick(conn->nick_key, conn->nick);
+            nick_insert(&srv->nick_registry, conn);
+        }
+
+        /* the rest of a half-written frame goes out first, then the queues in order */
+        if (rec.sending_len) {
+            frame = frame_recv(fd, rec.sending_len);
+            conn->sending = malloc(sizeof(struct outq_node));
+            if (conn->sending == NULL) {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+            }
+            frame->refs = 1;
+            conn->sending->frame = frame;
+            conn->sending->next = NULL;
+            conn->sending_off = 0;
+        }
+        for (int q = 0; q < OUTQ_NUM; q++) {
+            for (uint32_t f = 0; f < rec.num_frames[q]; f++) {
+                if (read_full(fd, &len, sizeof(len)) != sizeof(len)) {
+                    perror("hot restart");
+                    exit(EXIT_FAILURE);
+                }
+                conn_enqueue(conn, frame_recv(fd, len), q);
+            }
+        }
+
+        srv->fds[srv->num_fds].fd = client_fd;
+        srv->fds[srv->num_fds].events = POLLIN;
+        srv->conns[srv->num_fds] = conn;
+        srv->num_fds++;
+    }
+
+    /* everything's here; the old server stops touching these sockets once it reads this */
+    if (write_full(fd, "", 1) < 0) {
+        perror("hot restart");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    config->takeover_fd = -1;
+}
+
+/* handles one complete frame from conns[i]. returns 1 if the client should be dropped */
+static int server_handle_msg(struct server *srv, int i)
+{
+    struct conn *conn = srv->conns[i];
+    struct msg *msg = &conn->in;
+    char old_nick[NICK_SIZE];
+    int forward = 1, remove = 0;
+
+    if (msg->trace[TRACE_CLIENT_SEND]) {
+        msg->trace[TRACE_SERVER_RECV] = now_ns();
+    }
+    switch(msg->type) {
+    case MSG_JOIN:
+        if (conn->nick[0] == '\0') { /* if we don't have a nick for this user yet */
+            /* make sure the nick is valid and isn't taken already */
+            if (nick_claim(&srv->nick_registry, conn, msg->nick)) {
+                snprintf(msg->msg, sizeof(msg->msg), "%s joined the chat!", conn->nick);
+            } else {
+                /* nick taken; reject this join */
+                msg->type = MSG_JOIN_REJECTED;
+                server_send(srv, conn, msg);
+                forward = 0;
+            }
+        } else {
+            /* ignore rejoin */
+            forward = 0;
+        }
+        break;
+    case MSG_RENAME:
+        if (conn->nick[0] == '\0') {
+            /* can't rename before joining */
+            forward = 0;
+            break;
+        }
+        memcpy(old_nick, conn->nick, NICK_SIZE);
+        if (nick_claim(&srv->nick_registry, conn, msg->nick)) {
+            snprintf(msg->msg, sizeof(msg->msg), "%s is now known as %s", old_nick, conn->nick);
+        } else {
+            /* tell only the requester; msg->nick still holds the rejected nick */
+            msg->type = MSG_RENAME_REJECTED;
+            msg->user_id = conn->user_id;
+            server_send(srv, conn, msg);
+            forward = 0;
+        }
+        break;
+    case MSG_CLEAR_HISTORY:
+        if (conn->nick[0] != '\0') {
+            snprintf(msg->msg, sizeof(msg->msg), "%s cleared history!", conn->nick);
+        } else {
+            /* received clear history from someone who hasn't given a nick yet */
+            forward = 0;
+        }
+        break;
+    case MSG_QUIT:
+        if (conn->nick[0] != '\0') {
+            snprintf(msg->msg, sizeof(msg->msg), "%s left the chat!", conn->nick);
+        } else {
+            /* received quit from someone who hasn't given a nick yet */
+            forward = 0;
+        }
+        conn->left = 1;
+        remove = 1;
+        break;
+    case MSG_CHUNK:
+        if (msg->chunk_offset == 0) {
+            /* start of a new chunked message */
+            conn->chunk_id = msg->chunk_id;
+            conn->chunk_left = msg->chunk_total <= MAX_PASTE_SIZE ? msg->chunk_total : 0;
+        }
+        if (conn->nick[0] == '\0' || conn->chunk_left == 0 || msg->chunk_id != conn->chunk_id ||
+                msg->len == 0 || msg->len > conn->chunk_left ||
+                msg->chunk_offset + conn->chunk_left != msg->chunk_total) {
+            /* too big, empty, out of order or not part of the message we're streaming */
+            conn->chunk_left = 0;
+            forward = 0;
+            break;
+        }
+        conn->chunk_left -= msg->len;
+        conn->typing_pending = 0;
+        break;
+    case MSG_TYPING:
+        /* coalesced; server_flush_typing() sends the latest state when it's due */
+        if (conn->nick[0] != '\0' && (msg->msg[0] == TYPING_START_CMD ||
+                msg->msg[0] == TYPING_END_CMD || msg->msg[0] == TYPING_STALLED_CMD)) {
+            conn->typing_pending = msg->msg[0];
+        }
+        forward = 0;
+        break;
+    case MSG_NORMAL:
+        /* supersedes whatever typing state we were holding */
+        conn->typing_pending = 0;
+        /* clean it once here rather than in every client; chunks are left to the receivers */
+        msg->len = sanitize_text(msg->msg, msg->len, 1);
+        msg->msg[msg->len] = '\0';
+        break;
+    case MSG_STATS:
+        if (conn->nick[0] != '\0') {
+            server_format_stats(srv, msg->msg, sizeof(msg->msg));
+            msg->user_id = conn->user_id;
+            server_send(srv, conn, msg);
+        }
+        forward = 0;
+        break;
+    case MSG_REDACT:
+        break;
+    default:
+        printf("received unknown command: %d, ignoring\n", msg->type);
+        /* make sure we don't write anything to other clients */
+        forward = 0;
+        break;
+    }
+
+    memcpy(msg->nick, conn->nick, NICK_SIZE);
+    msg->user_id = conn->user_id;
+
+    /* propogate this message to all other sockets */
+    /* we want to write this message back to the socket it came from, too */
+    if (forward) {
+        server_broadcast(srv, msg, NULL);
+    }
+
+    return remove;
+}
+
+/* broadcasts typing states that are due. returns ms until the next one is, or -1 if none are waiting */
+static int server_flush_typing(struct server *srv)
+{
+    struct conn *conn;
+    struct msg msg = {0};
+    uint64_t now = now_ns(), interval = TYPING_INTERVAL_MS * 1000000ULL, wait;
+    int timeout = -1;
+
+    for (int i = SERVER_FD_FIRST_CONN; i < srv->num_fds; i++) {
+        conn = srv->conns[i];
+        if (!conn->typing_pending) {
+            continue;
+        }
+        if (now - conn->typing_sent_ns < interval) {
+            wait = (conn->typing_sent_ns + interval - now + 999999) / 1000000;
+            if (timeout < 0 || (int)wait < timeout) {
+                timeout = wait;
+            }
+            continue;
+        }
+
+        msg.type = MSG_TYPING;
+        msg.time = time(NULL);
+        msg.user_id = conn->user_id;
+        memcpy(msg.nick, conn->nick, NICK_SIZE);
+        msg.msg[0] = conn->typing_pending;
+        server_broadcast(srv, &msg, conn);
+        conn->typing_pending = 0;
+        conn->typing_sent_ns = now;
+    }
+
+    return timeout;
+}
+
+void * server_thread(void *arg)
+{
+    int fd, client_fd;
+    struct sockaddr_un client_sock;
+    struct server_config *config = (struct server_config *)arg;
+    struct sockaddr_un *sock = &config->sock;
+    socklen_t client_sock_len;
+    struct server *srv;
+    struct conn *conn;
+    struct handoff_header header;
+    struct capture_header capture_header = { CAPTURE_MAGIC, CAPTURE_VERSION, 0 };
+    struct msg join;
+    uint64_t now, wait;
+    int flags, bulk_backlog, remove, timeout = -1, typing_timeout = -1;
+
+    srv = calloc(1, sizeof(struct server));
+    if (srv == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    if (config->max_users < 1) {
+        config->max_users = MAX_USERS;
+    }
+    if (config->takeover_fd >= 0) {
+        fd = server_takeover_header(config, &header);
+    }
+    srv->fds = calloc(SERVER_FD_FIRST_CONN + config->max_users, sizeof(struct pollfd));
+    srv->conns = calloc(SERVER_FD_FIRST_CONN + config->max_users, sizeof(struct conn *));
+    if (srv->fds == NULL || srv->conns == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    srv->num_fds = SERVER_FD_FIRST_CONN;
+    srv->next_user_id = 1;
+    srv->config = config;
+    srv->stats.start_ns = now_ns();
+    nick_registry_init(&srv->nick_registry, config->max_users);
+
+    /* a burst has to fit at least one frame or that frame would wait forever */
+    if (config->burst_msgs < 1) {
+        config->burst_msgs = 1;
+    }
+    if (config->burst_bytes < sizeof(struct msg)) {
+        config->burst_bytes = sizeof(struct msg);
+    }
+
+    if (config->takeover_fd >= 0) {
+        server_takeover(srv, &header);
+    } else {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            perror("socket");
+            exit(EXIT_FAILURE);
+        }
+
+        if (bind(fd, (struct sockaddr *)sock, sizeof(struct sockaddr_un)) < 0) {
+            perror("bind");
+            exit(EXIT_FAILURE);
+        }
+
+        if (listen(fd, 10) < 0) {
+            perror("bind");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    srv->fds[SERVER_FD_LISTEN].fd = fd;
+    srv->fds[SERVER_FD_LISTEN].events = POLLIN;
+    /* poll skips negative fds, so without a stop pipe this never fires */
+    srv->fds[SERVER_FD_STOP].fd = config->stop_fd;
+    srv->fds[SERVER_FD_STOP].events = POLLIN;
+    srv->fds[SERVER_FD_CONTROL].fd = config->control_fd;
+    srv->fds[SERVER_FD_CONTROL].events = POLLIN;
+
+    /* capture times are relative to when this session started */
+    if (config->capture) {
+        capture_header.start_ns = srv->stats.start_ns;
+        if (fwrite(&capture_header, sizeof(capture_header), 1, config->capture) != 1) {
+            perror("capture");
+            config->capture = NULL;
+        }
+        /* clients taken over from another server were already here: they go in as if they'd just
+         * connected and joined, or a replay would have nothing to send their frames down */
+        for (int i = SERVER_FD_FIRST_CONN; i < srv->num_fds; i++) {
+            conn = srv->conns[i];
+            server_capture(srv, conn, CAPTURE_CONNECT, NULL);
+            if (conn->nick[0]) {
+                memset(&join, 0, sizeof(join));
+                join.type = MSG_JOIN;
+                join.time = time(NULL);
+                memcpy(join.nick, conn->nick, NICK_SIZE);
+                server_capture(srv, conn, CAPTURE_FRAME, &join);
+            }
+        }
+    }
+
+    while (!(srv->fds[SERVER_FD_STOP].revents & (POLLIN | POLLHUP))) {
+        /* chunked messages wait while any client is backed up on them; everything else keeps flowing */
+        bulk_backlog = 0;
+        for (int i = SERVER_FD_FIRST_CONN; i < srv->num_fds; i++) {
+            if (srv->conns[i]->out[OUTQ_BULK].bytes > OUTQ_BULK_HIGH_WATER) {
+                bulk_backlog = 1;
+            }
+        }
+        now = now_ns();
+        timeout = typing_timeout;
+        for (int i = SERVER_FD_FIRST_CONN; i < srv->num_fds; i++) {
+            conn = srv->conns[i];
+            srv->fds[i].events = 0;
+            if (conn->held) {
+                /* wake up when its tokens come in */
+                wait = conn->held_until > now ? (conn->held_until - now + 999999) / 1000000 : 0;
+                if (timeout < 0 || (int)wait < timeout) {
+                    timeout = wait;
+                }
+            } else if (!(bulk_backlog && conn->chunk_left)) {
+                srv->fds[i].events |= POLLIN;
+            }
+            if (conn_has_output(conn)) {
+                srv->fds[i].events |= POLLOUT;
+            }
+        }
+
+        if (poll(srv->fds, srv->num_fds, timeout) < 0) {
+            /* interrupted by a signal; recompute timeouts and look at the stop pipe */
+            for (int i = 0; i < srv->num_fds; i++) {
+                srv->fds[i].revents = 0;
+            }
+            continue;
+        }
+        /* a replacement wants our clients; once it has them it's the server */
+        if (srv->fds[SERVER_FD_CONTROL].revents & POLLIN && server_handoff(srv)) {
+            break;
+        }
+        /* check new connection fd */
+        if (srv->fds[SERVER_FD_LISTEN].revents & POLLIN) {
+            client_sock_len = sizeof(client_sock);
+            client_fd = accept(fd, (struct sockaddr *)&client_sock, &client_sock_len);
+
+            if (client_fd >= 0 && srv->num_fds - SERVER_FD_FIRST_CONN >= (int)config->max_users) {
+                /* room is full */
+                close(client_fd);
+            } else if (client_fd >= 0) {
+                /* non blocking socket */
+                flags = fcntl(client_fd, F_GETFL, 0);
+                fcntl(client_fd, F_SETFL, flags | O_NONBLOCK);
+
+                /* put client_fd into empty fds slot */
+                srv->fds[srv->num_fds].fd = client_fd;
+                srv->fds[srv->num_fds].events = POLLIN;
+                srv->fds[srv->num_fds].revents = 0;
+
+                /* new connection record; it has no nick until it joins */
+                conn = calloc(1, sizeof(struct conn));
+                if (conn == NULL) {
+                    perror("calloc");
+                    exit(EXIT_FAILURE);
+                }
+                conn->fd = client_fd;
+                conn->user_id = srv->next_user_id++;
+                now = now_ns();
+                bucket_init(&conn->msg_bucket, config->rate_msgs, config->burst_msgs, now);
+                bucket_init(&conn->byte_bucket, config->rate_bytes, config->burst_bytes, now);
+                srv->conns[srv->num_fds] = conn;
+                server_capture(srv, conn, CAPTURE_CONNECT, NULL);
+
+                srv->num_fds++;
+            }
+        }
+        if ((srv->fds[SERVER_FD_LISTEN].revents & ~POLLIN) > 0) {
+            printf("server fd has an event other than POLLIN: %x\n", srv->fds[SERVER_FD_LISTEN].revents);
+        }
+        /* figure out which fds have events. at most one frame per client per round keeps things fair */
+        now = now_ns();
+        for (int i = SERVER_FD_FIRST_CONN; i < srv->num_fds; i++) {
+            remove = 0;
+            conn = srv->conns[i];
+            if (srv->fds[i].revents & POLLHUP) {
+                conn->hung_up = 1;
+            }
+            if (conn->held) {
+                /* already read; see if it can go now */
+                if (server_admit(srv, conn, now)) {
+                    remove = server_handle_msg(srv, i);
+                }
+            } else if (srv->fds[i].revents & POLLIN) {
+                /* there is data available on this fd */
+                switch (conn_read(conn)) {
+                case 1:
+                    server_capture(srv, conn, CAPTURE_FRAME, &conn->in);
+                    if (server_admit(srv, conn, now)) {
+                        remove = server_handle_msg(srv, i);
+                    }
+                    break;
+                case -1:
+                    remove = 1;
+                    break;
+                default:
+                    break;
+                }
+            }
+
+            if (srv->fds[i].revents & POLLHUP && !(srv->fds[i].revents & POLLIN) && !conn->held) {
+                remove = 1;
+            }
+            if (srv->fds[i].revents & POLLERR || srv->fds[i].revents & POLLNVAL) {
+                remove = 1;
+            }
+            if (remove) {
+                server_remove_conn(srv, i);
+                /* the moved entry still needs its events handled this round */
+                i--;
+            }
+        }
+
+        typing_timeout = server_flush_typing(srv);
+
+        /* push out whatever this round produced */
+        for (int i = SERVER_FD_FIRST_CONN; i < srv->num_fds; i++) {
+            conn = srv->conns[i];
+            remove = conn_flush(conn) < 0;
+            if (conn->out[OUTQ_NORMAL].bytes + conn->out[OUTQ_BULK].bytes > OUTQ_MAX_BYTES) {
+                srv->stats.dropped++;
+                remove = 1;
+            }
+            if (remove) {
+                server_remove_conn(srv, i);
+                i--;
+            }
+        }
+    }
+
+    server_shutdown(srv);
+
+    return NULL;
+}